@@ -46,9 +46,10 @@ def test(input_path, truth_path, log_folder, text_path=None, \
         with open(text_path, "r", encoding="utf-8") as f:
             lines = f.readlines()
             f.close()
+        results = cut_many(ac, [line.strip() for line in lines], delim=delim)
         with open(output_path, "w", encoding="utf-8") as f:
-            for line in lines:
-                f.write(cut(ac, line.strip(), delim=delim) + "\n")
+            for res in results:
+                f.write(res + "\n")
             f.close()
         del ac
     elif method == 2:
@@ -96,9 +97,10 @@ def test(input_path, truth_path, log_folder, text_path=None, \
         with open(text_path, "r", encoding="utf-8") as f:
             lines = f.readlines()
             f.close()
+        results = ac.max_cut_batch([line.strip() for line in lines], delim)
         with open(output_path, "w", encoding="utf-8") as f:
-            for line in lines:
-                f.write(max_cut(ac, line.strip(), delim) + "\n")
+            for res in results:
+                f.write(res + "\n")
             f.close()
         del ac
     elif method == 4:
@@ -117,9 +119,10 @@ def test(input_path, truth_path, log_folder, text_path=None, \
         with open(text_path, "r", encoding="utf-8") as f:
             lines = f.readlines()
             f.close()
+        results = ac.max_cut_batch([line.strip() for line in lines], delim, reverse=True)
         with open(output_path, "w", encoding="utf-8") as f:
-            for line in lines:
-                f.write(max_cut(ac, line.strip(), delim, True) + "\n")
+            for res in results:
+                f.write(res + "\n")
             f.close()
         del ac
 
@@ -1,173 +1,54 @@
-from automaton import Automaton
+from automaton import Automaton, StreamSegmenter
 
-import regex as re
 import numpy as np
 import os
 from openai import OpenAI
 from tqdm import tqdm
 
-# Find all positions of integers and decimals in the text
-def find_number(text):
-    pattern = r"[-+]?\d+((\.|\．|\:|\：|\-|\－|\/)\d+)*"
-
-    matches = re.finditer(pattern, text)
-    
-    positions = [(match.start(), match.end()) for match in matches]
-
-    return positions
-
-# Find all positions of English words in the text
-def find_alpha(text):
-    pattern = r"[a-zA-Z]+(['-][a-zA-Z]+)*"
-    
-    matches = re.finditer(pattern, text)
-    
-    positions = [(match.start(), match.end()) for match in matches]
-
-    return positions
-
-# Check if the character is a symbol
-def is_symbol(char):
-    return re.match(r'\p{P}|\p{S}', char) is not None
-
 # Get the probability DAG
+# Candidate edges (pre, prob) of the word text[pre + 1: cur + 1] ending at each position cur:
+# a single character (symbols score min_prob / 2), numbers (min_prob / 4), English words (min_prob / 2)
+# and dictionary words. Built in C++ by Automaton.lattice, the rules are in automaton/src/pretokenize.h.
 def get_DAG(ac: Automaton, text: str, unigram=False, patterns=None):
-    # initiate
-    n = len(text)
-    min_prob = -ac.get_node(0)["log_trie_sum"]
-    edges = [[(i - 1, min_prob if not is_symbol(text[i]) else min_prob / 2)] for i in range(n)]
-
-    # number
-    number_pos = find_number(text)
-    for p in number_pos:
-        edges[p[1] - 1].append((p[0] - 1, min_prob / 4))
-
-    # alpha
-    alpha_pos = find_alpha(text)
-    for p in alpha_pos:
-        edges[p[1] - 1].append((p[0] - 1, min_prob / 2))
+    offsets, start, score = ac.lattice(text, unigram=unigram)
+    edges = [
+        [(int(start[k]) - 1, float(score[k])) for k in range(offsets[cur], offsets[cur + 1])]
+        for cur in range(len(text))
+    ]
 
     # other patterns
     # TODO: add configurable patterns
     if patterns:
         pass
 
-    # dict
-    ac.reset()
-    pre = -1
-    for cur in range(n):
-        node_id = ac.trans_string(text[cur])["id"]
-        borders = ac.get_borders(node_id)
-        for border in borders:
-            if border["end"] == 0:
-                continue
-            pre_node = ac.get_node(border["pre"])
-            len_border = border["length"]
-            if len_border == 0:
-                break
-            log_cnt_pre = pre_node["log_trie_sum"] if not unigram else -min_prob
-            log_cnt_border = border["log_end"]
-            prob = log_cnt_border - log_cnt_pre
-            edges[cur].append((cur - len_border, prob))
-
     return edges
-    
-def cut(ac: Automaton, text: str, delim=None, unigram=False, return_prob=False):
-    edges = get_DAG(ac, text, unigram=unigram)
-    min_prob = -ac.get_node(0)["log_trie_sum"]
-    n = len(text)
-    paths = {}
-
-    # viterbi
-    paths[-1] = (-1, 0)
-    for cur in range(n):
-        max_prob = float('-inf')
-        for edge in edges[cur]:
-            tpre, prob = edge
-            if paths[tpre][1] + prob > max_prob:
-                max_prob = paths[tpre][1] + prob
-                pre = tpre
-        paths[cur] = (pre, max_prob)
-    cuts = []
-    cur = n - 1
-    while cur != -1:
-        pre = paths[cur][0]
-        cuts.append(text[pre + 1: cur + 1])
-        cur = pre
-    cuts.reverse()
-
-    if delim:
-        cuts = delim.join(cuts)
 
-    return (cuts, max_prob) if return_prob else cuts
+# Viterbi over the edges of get_DAG, implemented in C++
+def cut(ac: Automaton, text: str, delim=None, unigram=False, return_prob=False):
+    return ac.cut_viterbi(text, delim=delim if delim else None, unigram=unigram, return_prob=return_prob)
 
 def cut_cpp(ac: Automaton, text: str, delim=None):
-    words = ac.cut(text)
-    
     if delim:
-        words = delim.join(words)
+        return ac.cut(text, delim=delim)
 
-    return words
+    return ac.cut(text)
 
-def cutf(ac: Automaton, input_path: str, output_path: str, delim=" ", unigram=False):
-    with open(input_path, "r", encoding="utf-8") as f:
-        lines = f.readlines()
-        f.close()
-
-    res = ""
-
-    for line in lines:
-        res += cut(ac, line, delim=delim, unigram=unigram)
-        # res += cut_cpp(ac, line, delim=delim)
+# `cut` of every text, in parallel C++ threads (threads=0: one per core)
+def cut_many(ac: Automaton, texts, delim=None, unigram=False, threads=0):
+    return ac.cut_viterbi_many(texts, delim=delim if delim else None, unigram=unigram, threads=threads)
 
+# `cut` of every line of input_path, read, cut in parallel and written by C++
+def cutf(ac: Automaton, input_path: str, output_path: str, delim=" ", unigram=False, threads=0):
     dir_path = os.path.dirname(output_path)
 
     if not os.path.exists(dir_path):
         os.makedirs(dir_path)
 
-    with open(output_path, "w", encoding="utf-8") as f:
-        f.write(res)
+    ac.cut_viterbi_file(input_path, output_path, delim=delim, unigram=unigram, threads=threads)
 
+# Forward (FMM) or backward (BMM, reverse=True) maximum matching, implemented in C++
 def max_cut(ac: Automaton, text: str, delim=None, reverse=False):
-    ac.reset()
-    n = len(text)
-
-    if reverse:
-        pre = [i - 1 for i in range(n)]
-        for cur in range(n):
-            node_id = ac.trans_string(text[cur])["id"]
-            borders = ac.get_borders(node_id)
-            for border in borders:
-                len_border = border["length"]
-                if len_border == 0:
-                    break
-                pre[cur] = min(pre[cur], cur - len_border)
-        cuts = []
-        cur = n - 1
-        while cur != -1:
-            cuts.append(text[pre[cur] + 1: cur + 1])
-            cur = pre[cur]
-        cuts.reverse()
-    else:
-        nxt = [i + 1 for i in range(n)]
-        for cur in range(n):
-            node_id = ac.trans_string(text[cur])["id"]
-            borders = ac.get_borders(node_id)
-            for border in borders:
-                len_border = border["length"]
-                if len_border == 0:
-                    break
-                nxt[cur - len_border + 1] = max(nxt[cur - len_border + 1], cur + 1)
-        cuts = []
-        cur = 0
-        while cur != n:
-            cuts.append(text[cur: nxt[cur]])
-            cur = nxt[cur]
-
-    if delim:
-        cuts = delim.join(cuts)
-
-    return cuts
+    return ac.max_cut(text, delim=delim if delim else None, reverse=reverse)
 
 DEFAULT_SYSTEM_PROMPT_EN = "Segment the text into words with spaces. Every punctuation should be a single part. DO NOT output other content!"
 DEFAULT_SYSTEM_PROMPT_ZH = "请对下列文本进行分词，词之间以空格隔开，除了分词结果之外不需要多余回答"
@@ -221,11 +102,13 @@ def get_ppl(ac: Automaton, file_path: str):
         lines = f.readlines()
         f.close()
 
+    texts = [line.strip() for line in lines]
+    logps_ac_uni = ac.log_prob_batch(texts, unigram=True)
+    logps_ac = ac.log_prob_batch(texts)
+
     ppl_ac_uni = 0
     ppl_ac = 0
-    for line in lines:
-        _, logp_ac_uni = cut(ac, line.strip(), unigram=True, return_prob=True)
-        _, logp_ac = cut(ac, line.strip(), return_prob=True)
+    for line, logp_ac_uni, logp_ac in zip(lines, logps_ac_uni, logps_ac):
         ppl_ac_uni += logp_ac_uni / len(line)
         ppl_ac += logp_ac / len(line)
         
@@ -1,4 +1,4 @@
-from .LLACA import cut, cutf, max_cut, llm_cut, Automaton, run, build_dict
+from .LLACA import cut, cutf, max_cut, llm_cut, Automaton, StreamSegmenter, run, build_dict
 
 __all__ = [
     'cut',
@@ -6,6 +6,7 @@ __all__ = [
     'max_cut',
     'llm_cut',
     'Automaton',
+    'StreamSegmenter',
     'run',
     'build_dict'
 ]
\ No newline at end of file
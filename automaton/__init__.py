@@ -1 +1 @@
-from .Automaton import Automaton
\ No newline at end of file
+from .Automaton import Automaton, StreamSegmenter
\ No newline at end of file
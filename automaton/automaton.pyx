@@ -3,11 +3,21 @@
 cimport cython
 from libcpp.vector cimport vector
 from libcpp.string cimport string
+from libcpp.pair cimport pair
+from libcpp cimport bool
+from cpython.unicode cimport PyUnicode_DecodeUTF8
+from cpython.buffer cimport PyObject_CheckBuffer
+from cython.operator cimport preincrement
+
+import numpy as np
+import pickle
+from multiprocessing import shared_memory
 
 cdef extern from "stdint.h":
     ctypedef unsigned char uint8_t
     ctypedef unsigned int uint32_t
     ctypedef unsigned long long uint64_t
+    ctypedef long long int64_t
 
 cdef extern from "src/automaton.h" namespace "automaton":
     const uint32_t ROOT
@@ -22,97 +32,457 @@ cdef extern from "src/automaton.h" namespace "automaton":
         float log_trie_sum
         uint64_t trie_sum
 
+    cdef cppclass CacheStats "automaton::CacheStats":
+        uint64_t hits
+        uint64_t misses
+        uint64_t entries
+        uint64_t bytes
+
+    cdef enum MatchPolicy "automaton::MatchPolicy":
+        OVERLAPPING "automaton::MatchPolicy::OVERLAPPING"
+        NON_OVERLAPPING "automaton::MatchPolicy::NON_OVERLAPPING"
+        LEFTMOST_LONGEST "automaton::MatchPolicy::LEFTMOST_LONGEST"
+
+    cdef cppclass Match "automaton::Match":
+        uint32_t begin
+        uint32_t end
+        uint32_t id
+
+    cdef cppclass Lattice "automaton::Lattice":
+        vector[uint32_t] offsets
+        vector[uint32_t] start
+        vector[double] score
+
+    cdef cppclass MemoryEstimate "automaton::MemoryEstimate":
+        uint64_t words
+        uint64_t nodes
+        uint64_t built_bytes
+        uint64_t peak_bytes
+        uint64_t image_bytes
+        uint64_t static_bytes
+
+    cdef cppclass WordRange "automaton::WordRange":
+        cppclass iterator:
+            iterator& operator++()
+            bint operator!=(iterator)
+            uint32_t begin()
+            uint32_t end()
+        WordRange()
+        iterator begin()
+        iterator end()
+        size_t size()
+
     cdef cppclass AutomatonImpl "automaton::Automaton":
         AutomatonImpl() except +
         AutomatonImpl(string dict_path) except +
         AutomatonImpl(vector[string] dict_paths) except +
         void insert(string s, uint64_t freq) except +
+        size_t memory_usage() except +
         uint32_t word_count() except +
+        uint32_t max_length() except +
         Node get_node(uint32_t node_id) except +
+        uint64_t word_freq(uint32_t node_id)
+        uint32_t word_length(uint32_t node_id)
+        uint32_t node_count()
+        void node_table(uint64_t* end, uint32_t* length, uint32_t* parent, uint32_t* pre, uint32_t* fail,
+                        float* log_end, float* log_trie_sum, uint64_t* trie_sum, uint32_t* ch) nogil
         Node trans_string(string s) except +
         Node trans_byte(uint8_t byte) except +
+        void trans(size_t n, const uint32_t* states, const uint8_t* bytes, uint32_t* out) except + nogil
+        void trans_text(const char* text, size_t n, uint32_t state, uint32_t* out) except + nogil
         vector[Node] get_borders(uint32_t node_id) except +
         void reset(uint32_t new_state) except +
-        void build(vector[string] dict_paths) except +
-        void load_dict(string dict_path) except +
-        vector[string] cut(string text) except +
+        void build(vector[string] dict_paths) except + nogil
+        vector[pair[string, uint64_t]] build(vector[string] dict_paths, size_t max_bytes) except + nogil
+        @staticmethod
+        MemoryEstimate estimate(vector[string] dict_paths, uint8_t normalization) except + nogil
+        void load_dict(string dict_path) except + nogil
+        void set_normalization(uint8_t flags) except +
+        uint8_t normalization()
+        string serialize() except + nogil
+        void deserialize(const char* data, size_t n) except + nogil
+        void cut_bounds(const char* text, size_t n, vector[uint32_t]& bounds) except + nogil
+        WordRange words(const char* text, size_t n) except + nogil
+        void cut_all_spans(const char* text, size_t n, vector[uint32_t]& spans) except + nogil
+        void cut_bounds_batch(size_t count, const char* const* texts, const size_t* lengths,
+                              vector[uint32_t]* bounds, unsigned streams) except + nogil
+        void cut_offsets(size_t count, const char* const* texts, const size_t* lengths,
+                         vector[int64_t]& word_ptr, vector[int64_t]& spans) except + nogil
+        void cut_offsets(const char* data, size_t n, vector[int64_t]& word_ptr, vector[int64_t]& spans) except + nogil
+        void cut_file(string input_path, string output_path, string delim, unsigned threads) except + nogil
+        void cut_bounds_many(size_t count, const char* const* texts, const size_t* lengths,
+                             vector[uint32_t]* bounds, unsigned threads) except + nogil
+        void enable_cache(size_t max_bytes, unsigned shards) except +
+        void disable_cache() except +
+        void clear_cache() except +
+        CacheStats cache_stats() except +
+        uint64_t generation() except +
+        double cut_viterbi_bounds(const char* text, size_t n, vector[uint32_t]& bounds, bool unigram) except + nogil
+        void cut_viterbi_bounds_many(size_t count, const char* const* texts, const size_t* lengths,
+                                     vector[uint32_t]* bounds, bool unigram, unsigned threads) except + nogil
+        void cut_viterbi_file(string input_path, string output_path, string delim, bool unigram,
+                              unsigned threads) except + nogil
+        Lattice lattice(const char* text, size_t n, bool unigram) except + nogil
+        vector[pair[vector[uint32_t], double]] cut_nbest_bounds(const char* text, size_t n, size_t k,
+                                                                bool unigram) except + nogil
+        void max_cut_bounds(const char* text, size_t n, vector[uint32_t]& bounds, bool reverse) except + nogil
+        void max_cut_file(string input_path, string output_path, string delim, bool reverse, unsigned threads) except + nogil
+        void write_source(string name, string header_path, string source_path) except + nogil
+        vector[Match] find_all(const char* text, size_t n, MatchPolicy policy) except + nogil
+
+cdef extern from "src/normalize.h" namespace "normalize":
+    cdef uint8_t FULL_WIDTH
+    cdef uint8_t CASE_FOLD
+
+cdef extern from "src/stream_segmenter.h" namespace "automaton":
+    cdef cppclass StreamSegmenterImpl "automaton::StreamSegmenter":
+        StreamSegmenterImpl(const AutomatonImpl& automaton) except +
+        vector[string] feed(const char* chunk, size_t n) except + nogil
+        vector[string] finish() except + nogil
+        void reset() except +
+
+cdef const unsigned char[::1] _utf8_view(text):
+    # UTF-8 bytes of a str, or a bytes-like object (bytes, bytearray, memoryview, mmap) used in place
+    if isinstance(text, str):
+        return text.encode('utf-8')
+    return text
+
+cdef inline const char* _view_data(const unsigned char[::1] view) noexcept:
+    if view.shape[0] == 0: # No element to point at
+        return ""
+    return <const char*>&view[0]
+
+cdef list _split_words(const char* text, const vector[uint32_t]& bounds):
+    # Word k is text[bounds[k], bounds[k + 1])
+    cdef size_t k
+    return [PyUnicode_DecodeUTF8(text + bounds[k - 1], bounds[k] - bounds[k - 1], NULL) for k in range(1, bounds.size())]
+
+cdef string _join_words(const char* text, const vector[uint32_t]& bounds, const string& delim):
+    cdef string res
+    cdef size_t k
+    if not bounds.empty():
+        res.reserve(bounds.back() * 2)
+    for k in range(1, bounds.size()):
+        if k > 1:
+            res.append(delim)
+        res.append(text + bounds[k - 1], bounds[k] - bounds[k - 1])
+    return res
+
+cdef list _utf8_views(texts, vector[const char*]& data, vector[size_t]& lengths):
+    # _utf8_view of every text, with their pointers and lengths. The views must be kept while C++ reads them
+    cdef const unsigned char[::1] view
+    views = []
+    for text in texts:
+        view = _utf8_view(text)
+        views.append(view)
+        data.push_back(_view_data(view))
+        lengths.push_back(view.shape[0])
+    return views
+
+cdef list _words_many(const vector[const char*]& data, const vector[vector[uint32_t]]& bounds, delim):
+    # Words (delim is None) or joined words of every text
+    cdef size_t k
+    cdef string cpp_delim
+    if delim is None:
+        return [_split_words(data[k], bounds[k]) for k in range(data.size())]
+    cpp_delim = delim.encode('utf-8')
+    return [_join_words(data[k], bounds[k], cpp_delim).decode('utf-8') for k in range(data.size())]
+
+cdef vector[string] _dict_paths(dict_paths):
+    # A path or a list of paths, none if dict_paths is None
+    cdef vector[string] res
+    if isinstance(dict_paths, str):
+        dict_paths = [dict_paths]
+    if isinstance(dict_paths, list):
+        for dict_path in dict_paths:
+            res.push_back(dict_path.encode())
+    return res
+
+cdef uint8_t _normalization(full_width, case_fold):
+    return (FULL_WIDTH if full_width else 0) | (CASE_FOLD if case_fold else 0)
+
+cdef object _int64_array(vector[int64_t]& values):
+    if values.empty():
+        return np.zeros(0, dtype=np.int64)
+    return np.array(<int64_t[:values.size()]> values.data())
+
+cdef MatchPolicy _match_policy(policy) except *:
+    if policy == "overlapping":
+        return OVERLAPPING
+    if policy == "non_overlapping":
+        return NON_OVERLAPPING
+    if policy == "leftmost_longest":
+        return LEFTMOST_LONGEST
+    raise ValueError(f"Unknown match policy: {policy}")
 
 cdef class Automaton:
     cdef AutomatonImpl* autom
+    cdef readonly list dropped # Keywords left out by the last build to fit max_bytes, see build
+    cdef size_t _readers # Calls reading the automaton without the GIL
+    cdef bint _writing # A call changing the automaton is running (maybe without the GIL)
 
-    def __cinit__(self, dict_paths = None):
+    def __cinit__(self, dict_paths = None, full_width = False, case_fold = False, max_bytes = None):
         self.autom = new AutomatonImpl()
+        self.dropped = []
+        self.set_normalization(full_width, case_fold)
         if dict_paths is not None:
-            self.build(dict_paths)
+            self.build(dict_paths, max_bytes)
+
+    # Calls that release the GIL let other Python threads run meanwhile. The automaton must not change under
+    # the ones reading it, so changing it while they run (or reading it while it changes) raises RuntimeError.
+    # The state is only touched with the GIL held.
+
+    cdef int _check_not_writing(self) except -1:
+        if self._writing:
+            raise RuntimeError("Automaton is being changed by another thread")
+        return 0
+
+    cdef int _begin_read(self) except -1:
+        # Before reading the automaton without the GIL, paired with _end_read
+        self._check_not_writing()
+        self._readers += 1
+        return 0
+
+    cdef void _end_read(self) noexcept:
+        self._readers -= 1
+
+    cdef int _begin_write(self) except -1:
+        # Before changing the automaton (insert, load_dict, build, set_normalization), paired with _end_write
+        self._check_not_writing()
+        if self._readers:
+            raise RuntimeError("Automaton cannot be changed while other threads are reading it")
+        self._writing = True
+        return 0
+
+    cdef void _end_write(self) noexcept:
+        self._writing = False
+
+    @staticmethod
+    def estimate(dict_paths, full_width = False, case_fold = False) -> dict:
+        # Size of the automaton Automaton(dict_paths, full_width, case_fold) would build, from reading the
+        # dictionaries only: its words, nodes, and bytes once built (memory_usage), at the peak of building,
+        # as an image (to_bytes) and as the tables of write_source
+        cdef vector[string] cpp_dict_paths = _dict_paths(dict_paths)
+        cdef uint8_t flags = _normalization(full_width, case_fold)
+        cdef MemoryEstimate est
+        with nogil:
+            est = AutomatonImpl.estimate(cpp_dict_paths, flags)
+        return {
+            'words': est.words,
+            'nodes': est.nodes,
+            'built_bytes': est.built_bytes,
+            'peak_bytes': est.peak_bytes,
+            'image_bytes': est.image_bytes,
+            'static_bytes': est.static_bytes
+        }
+
+    def set_normalization(self, full_width = False, case_fold = False):
+        # Read full-width ASCII and the ideographic space as ASCII (full_width), A-Z as a-z (case_fold),
+        # in the keywords and in the texts segmented. Word boundaries stay offsets into the original text.
+        # Must be set before inserting keywords, find_all and trans* are not affected
+        self._begin_write()
+        try:
+            self.autom.set_normalization(_normalization(full_width, case_fold))
+        finally:
+            self._end_write()
+
+    def normalization(self) -> dict:
+        cdef uint8_t flags = self.autom.normalization()
+        return {'full_width': (flags & FULL_WIDTH) != 0, 'case_fold': (flags & CASE_FOLD) != 0}
 
     def __dealloc__(self):
         del self.autom
 
+    def to_bytes(self) -> bytes:
+        # Binary image of the automaton, read back by from_bytes of the same LLACA build
+        cdef string image
+        self._begin_read()
+        try:
+            with nogil:
+                image = self.autom.serialize()
+        finally:
+            self._end_read()
+        return image
+
+    @staticmethod
+    def from_bytes(data):
+        # Automaton from the image of to_bytes at the start of a bytes-like object (bytes, memoryview, SharedMemory.buf)
+        cdef const unsigned char[::1] view = data
+        cdef const char* cpp_data = _view_data(view)
+        cdef size_t n = view.shape[0]
+        cdef Automaton res = Automaton()
+        with nogil:
+            res.autom.deserialize(cpp_data, n)
+        return res
+
+    def to_shared_memory(self):
+        # The image of to_bytes in a new multiprocessing SharedMemory. It pickles by name, so workers
+        # attach to it and call from_bytes(shm.buf) instead of receiving the image. The caller unlinks it.
+        image = self.to_bytes()
+        shm = shared_memory.SharedMemory(create=True, size=len(image))
+        shm.buf[:len(image)] = image
+        return shm
+
+    def __reduce_ex__(self, protocol):
+        # Pickled as the image of to_bytes, out of band with protocol 5 (pickle.PickleBuffer)
+        image = self.to_bytes()
+        if protocol >= 5:
+            image = pickle.PickleBuffer(image)
+        return Automaton.from_bytes, (image,)
+
     def insert(self, s, freq = 1):
         cdef string cpp_string = s.encode()
-        self.autom.insert(cpp_string, freq)
+        self._begin_write()
+        try:
+            self.autom.insert(cpp_string, freq)
+        finally:
+            self._end_write()
+
+    def memory_usage(self) -> int:
+        self._check_not_writing()
+        return self.autom.memory_usage()
 
     def word_count(self) -> int:
+        self._check_not_writing()
         return self.autom.word_count()
 
+    def max_length(self) -> int:
+        self._check_not_writing()
+        return self.autom.max_length()
+
     def get_node(self, node_id) -> dict:
+        self._check_not_writing()
         cdef Node node = self.autom.get_node(node_id)
         node_dict = {
-            'end': node.end,
+            'end': self.autom.word_freq(node.id),
             'trie_sum': node.trie_sum,
             'log_end': node.log_end,
             'log_trie_sum': node.log_trie_sum,
             'id': node.id,
             'pre': node.pre,
             'fail': node.fail,
-            'length': node.length
+            'length': self.autom.word_length(node.id)
         }
         return node_dict
     
     def trans_string(self, s) -> dict:
+        self._check_not_writing()
         cdef string cpp_string = s.encode()
         cdef Node node = self.autom.trans_string(cpp_string)
         node_dict = {
-            'end': node.end,
+            'end': self.autom.word_freq(node.id),
             'trie_sum': node.trie_sum,
             'log_end': node.log_end,
             'log_trie_sum': node.log_trie_sum,
             'id': node.id,
             'pre': node.pre,
             'fail': node.fail,
-            'length': node.length
+            'length': self.autom.word_length(node.id)
         }
         return node_dict
 
     def trans_byte(self, byte):
+        self._check_not_writing()
         cdef uint8_t cpp_byte = byte
         cdef Node node = self.autom.trans_byte(cpp_byte)
         node_dict = {
-            'end': node.end,
+            'end': self.autom.word_freq(node.id),
             'trie_sum': node.trie_sum,
             'log_end': node.log_end,
             'log_trie_sum': node.log_trie_sum,
             'id': node.id,
             'pre': node.pre,
             'fail': node.fail,
-            'length': node.length
+            'length': self.autom.word_length(node.id)
         }
         return node_dict
 
+    def node_count(self) -> int:
+        self._check_not_writing()
+        return self.autom.node_count()
+
+    def node_table(self) -> dict:
+        # Every node at once as NumPy arrays indexed by node id, with the keys of get_node (but id) plus
+        # 'parent' and 'ch', the transitions on the 16 nibbles (shape (node_count, 16)).
+        # A copy, it does not follow later inserts or builds.
+        n = self.autom.node_count()
+        table = {
+            'end': np.empty(n, dtype=np.uint64),
+            'length': np.empty(n, dtype=np.uint32),
+            'parent': np.empty(n, dtype=np.uint32),
+            'pre': np.empty(n, dtype=np.uint32),
+            'fail': np.empty(n, dtype=np.uint32),
+            'log_end': np.empty(n, dtype=np.float32),
+            'log_trie_sum': np.empty(n, dtype=np.float32),
+            'trie_sum': np.empty(n, dtype=np.uint64),
+            'ch': np.empty((n, 16), dtype=np.uint32),
+        }
+        cdef uint64_t[::1] end = table['end']
+        cdef uint32_t[::1] length = table['length']
+        cdef uint32_t[::1] parent = table['parent']
+        cdef uint32_t[::1] pre = table['pre']
+        cdef uint32_t[::1] fail = table['fail']
+        cdef float[::1] log_end = table['log_end']
+        cdef float[::1] log_trie_sum = table['log_trie_sum']
+        cdef uint64_t[::1] trie_sum = table['trie_sum']
+        cdef uint32_t[:, ::1] ch = table['ch']
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.node_table(&end[0], &length[0], &parent[0], &pre[0], &fail[0],
+                                      &log_end[0], &log_trie_sum[0], &trie_sum[0], &ch[0, 0])
+        finally:
+            self._end_read()
+        return table
+
+    def trans(self, states, bytes):
+        # Vectorized trans_byte: the states after reading bytes from states, elementwise with NumPy broadcasting.
+        # The current state (trans_string, trans_byte, reset) is not used.
+        states, bytes = np.broadcast_arrays(np.asarray(states, dtype=np.uint32), np.asarray(bytes, dtype=np.uint8))
+        res = np.empty(states.shape, dtype=np.uint32)
+        cdef const uint32_t[::1] cpp_states = np.ascontiguousarray(states).reshape(-1)
+        cdef const uint8_t[::1] cpp_bytes = np.ascontiguousarray(bytes).reshape(-1)
+        cdef uint32_t[::1] out = res.reshape(-1)
+        if out.shape[0]:
+            self._begin_read()
+            try:
+                with nogil:
+                    self.autom.trans(out.shape[0], &cpp_states[0], &cpp_bytes[0], &out[0])
+            finally:
+                self._end_read()
+        return res
+
+    def trans_text(self, text, state=ROOT):
+        # The state after each byte of the UTF-8 text (text as in `cut`), starting from `state`
+        cdef const unsigned char[::1] view = _utf8_view(text)
+        cdef const char* data = _view_data(view)
+        cdef uint32_t cpp_state = state
+        res = np.empty(view.shape[0], dtype=np.uint32)
+        cdef uint32_t[::1] out = res
+        if view.shape[0]:
+            self._begin_read()
+            try:
+                with nogil:
+                    self.autom.trans_text(data, view.shape[0], cpp_state, &out[0])
+            finally:
+                self._end_read()
+        return res
+
     def get_borders(self, node_id):
+        self._check_not_writing()
         cdef uint32_t cpp_node_id = node_id
         cdef vector[Node] borders = self.autom.get_borders(cpp_node_id)
         res = []
         for node in borders:
             node_dict = {
-                'end': node.end,
+                'end': self.autom.word_freq(node.id),
                 'trie_sum': node.trie_sum,
                 'log_end': node.log_end,
                 'log_trie_sum': node.log_trie_sum,
                 'id': node.id,
                 'pre': node.pre,
                 'fail': node.fail,
-                'length': node.length
+                'length': self.autom.word_length(node.id)
             }
             res.append(node_dict)
         return res
@@ -120,20 +490,440 @@ cdef class Automaton:
     def reset(self, new_state = ROOT):
         self.autom.reset(new_state)
 
-    def build(self, dict_paths=None):
-        if isinstance(dict_paths, str):
-            dict_paths = [dict_paths]
-        cdef vector[string] cpp_dict_paths
-        if isinstance(dict_paths, list):
-            for dict_path in dict_paths:
-                cpp_dict_paths.push_back(dict_path.encode())
-        self.autom.build(cpp_dict_paths)
+    def build(self, dict_paths=None, max_bytes=None):
+        # With max_bytes, the automaton must be empty and the lowest-frequency keywords are left out until
+        # memory_usage() fits in max_bytes. Returns the keywords left out as (word, freq), lowest first, also in dropped
+        cdef vector[string] cpp_dict_paths = _dict_paths(dict_paths)
+        cdef vector[pair[string, uint64_t]] cpp_dropped
+        cdef size_t cpp_max_bytes = 0 if max_bytes is None else max_bytes
+        self._begin_write()
+        try:
+            if max_bytes is None:
+                with nogil:
+                    self.autom.build(cpp_dict_paths)
+            else:
+                with nogil:
+                    cpp_dropped = self.autom.build(cpp_dict_paths, cpp_max_bytes)
+        finally:
+            self._end_write()
+        self.dropped = [(word.decode('utf-8'), freq) for word, freq in cpp_dropped]
+        return self.dropped
 
     def load_dict(self, dict_path):
-        cdef cpp_dict_path = dict_path.encode()
-        self.autom.load_dict(cpp_dict_path)
+        cdef string cpp_dict_path = dict_path.encode()
+        self._begin_write()
+        try:
+            with nogil:
+                self.autom.load_dict(cpp_dict_path)
+        finally:
+            self._end_write()
+
+    def cut(self, text, delim=None):
+        # text is a str or UTF-8 in a bytes-like object (bytes, bytearray, memoryview, mmap), which is not copied
+        cdef const unsigned char[::1] view = _utf8_view(text)
+        cdef const char* data = _view_data(view)
+        cdef size_t n = view.shape[0]
+        cdef vector[uint32_t] bounds
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.cut_bounds(data, n, bounds)
+        finally:
+            self._end_read()
+        if delim is not None:
+            return _join_words(data, bounds, delim.encode('utf-8')).decode('utf-8')
+        return _split_words(data, bounds)
+
+    def cut_all(self, text):
+        # Every candidate word of the full mode, overlapping, as a NumPy array of [begin, end) byte spans
+        # into the UTF-8 text (text as in `cut`), shape (words, 2) and ordered by end
+        cdef const unsigned char[::1] view = _utf8_view(text)
+        cdef const char* data = _view_data(view)
+        cdef size_t n = view.shape[0]
+        cdef vector[uint32_t] spans
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.cut_all_spans(data, n, spans)
+        finally:
+            self._end_read()
+        if spans.empty():
+            return np.zeros((0, 2), dtype=np.uint32)
+        return np.array(<uint32_t[:spans.size()]> spans.data()).reshape(-1, 2)
+
+    def cut_batch(self, texts, delim=None, streams=16):
+        # `cut` of every text (texts as in `cut`), the automaton traversals of `streams` texts at a time are interleaved
+        cdef vector[const char*] cpp_texts
+        cdef vector[size_t] lengths
+        views = _utf8_views(texts, cpp_texts, lengths)
+        cdef vector[vector[uint32_t]] bounds = vector[vector[uint32_t]](cpp_texts.size())
+        cdef unsigned cpp_streams = streams
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.cut_bounds_batch(cpp_texts.size(), cpp_texts.data(), lengths.data(), bounds.data(), cpp_streams)
+        finally:
+            self._end_read()
+        return _words_many(cpp_texts, bounds, delim)
+
+    def cut_offsets(self, texts):
+        # Words of many texts as NumPy arrays in CSR form, without creating any str:
+        # the words of text k are w in word_ptr[k]:word_ptr[k + 1], word w is the bytes spans[w, 0]:spans[w, 1].
+        # texts is either a list of texts as in `cut`, spans are then offsets into the UTF-8 of each text,
+        # or one str / bytes-like buffer of lines ("\n" or "\r\n"), spans are then offsets into the buffer
+        cdef const unsigned char[::1] view
+        cdef const char* data
+        cdef size_t n
+        cdef vector[const char*] cpp_texts
+        cdef vector[size_t] lengths
+        cdef vector[int64_t] word_ptr
+        cdef vector[int64_t] spans
+        if isinstance(texts, str) or PyObject_CheckBuffer(texts):
+            view = _utf8_view(texts)
+            data = _view_data(view)
+            n = view.shape[0]
+            self._begin_read()
+            try:
+                with nogil:
+                    self.autom.cut_offsets(data, n, word_ptr, spans)
+            finally:
+                self._end_read()
+        else:
+            views = _utf8_views(texts, cpp_texts, lengths)
+            self._begin_read()
+            try:
+                with nogil:
+                    self.autom.cut_offsets(cpp_texts.size(), cpp_texts.data(), lengths.data(), word_ptr, spans)
+            finally:
+                self._end_read()
+        return _int64_array(word_ptr), _int64_array(spans).reshape(-1, 2)
+
+    def cut_many(self, texts, delim=None, threads=0):
+        # `cut` of every text (texts as in `cut`), cut in parallel by `threads` C++ workers (0: one per core)
+        cdef vector[const char*] cpp_texts
+        cdef vector[size_t] lengths
+        views = _utf8_views(texts, cpp_texts, lengths)
+        cdef vector[vector[uint32_t]] bounds = vector[vector[uint32_t]](cpp_texts.size())
+        cdef unsigned cpp_threads = threads
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.cut_bounds_many(cpp_texts.size(), cpp_texts.data(), lengths.data(), bounds.data(), cpp_threads)
+        finally:
+            self._end_read()
+        return _words_many(cpp_texts, bounds, delim)
+
+    def words(self, text):
+        # Same words as `cut`, decoded one at a time while iterating. text as in `cut`, the iterator keeps it
+        cdef WordIterator res = WordIterator.__new__(WordIterator)
+        res.view = _utf8_view(text)
+        cdef const char* data = _view_data(res.view)
+        cdef size_t n = res.view.shape[0]
+        self._begin_read()
+        try:
+            with nogil:
+                res.range = self.autom.words(data, n)
+        finally:
+            self._end_read()
+        res.it = res.range.begin()
+        res.left = res.range.size()
+        return res
+
+    def cut_file(self, input_path, output_path, delim=" ", threads=0):
+        # Same output as `cutf` with `cut_cpp`, with lines cut in parallel (threads=0: one per core)
+        cdef string cpp_input_path = input_path.encode()
+        cdef string cpp_output_path = output_path.encode()
+        cdef string cpp_delim = delim.encode('utf-8')
+        cdef unsigned cpp_threads = threads
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.cut_file(cpp_input_path, cpp_output_path, cpp_delim, cpp_threads)
+        finally:
+            self._end_read()
+
+    def enable_cache(self, max_bytes=64 << 20, shards=16):
+        # Cache the results of `cut` and `cut_file`, keyed by the text and the build of the automaton
+        self.autom.enable_cache(max_bytes, shards)
+
+    def disable_cache(self):
+        self.autom.disable_cache()
+
+    def clear_cache(self):
+        self.autom.clear_cache()
+
+    def cache_stats(self) -> dict:
+        cdef CacheStats stats = self.autom.cache_stats()
+        return {
+            'hits': stats.hits,
+            'misses': stats.misses,
+            'entries': stats.entries,
+            'bytes': stats.bytes
+        }
+
+    def generation(self) -> int:
+        return self.autom.generation()
+
+    def cut_viterbi(self, text, delim=None, unigram=False, return_prob=False):
+        # Full-path Viterbi, same result as `cut` in TrieGram.py. text as in `cut`
+        cdef const unsigned char[::1] view = _utf8_view(text)
+        cdef const char* data = _view_data(view)
+        cdef size_t n = view.shape[0]
+        cdef bool cpp_unigram = unigram
+        cdef vector[uint32_t] bounds
+        cdef double log_prob
+        self._begin_read()
+        try:
+            with nogil:
+                log_prob = self.autom.cut_viterbi_bounds(data, n, bounds, cpp_unigram)
+        finally:
+            self._end_read()
+        if delim is not None:
+            res = _join_words(data, bounds, delim.encode('utf-8')).decode('utf-8')
+        else:
+            res = _split_words(data, bounds)
+        return (res, log_prob) if return_prob else res
+
+    def cut_viterbi_many(self, texts, delim=None, unigram=False, threads=0):
+        # `cut_viterbi` of every text, cut in parallel as in `cut_many`
+        cdef vector[const char*] cpp_texts
+        cdef vector[size_t] lengths
+        views = _utf8_views(texts, cpp_texts, lengths)
+        cdef vector[vector[uint32_t]] bounds = vector[vector[uint32_t]](cpp_texts.size())
+        cdef bool cpp_unigram = unigram
+        cdef unsigned cpp_threads = threads
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.cut_viterbi_bounds_many(cpp_texts.size(), cpp_texts.data(), lengths.data(), bounds.data(),
+                                                   cpp_unigram, cpp_threads)
+        finally:
+            self._end_read()
+        return _words_many(cpp_texts, bounds, delim)
+
+    def cut_viterbi_file(self, input_path, output_path, delim=" ", unigram=False, threads=0):
+        # Same output as `cutf` in TrieGram.py, with lines cut in parallel as in `cut_file`
+        cdef string cpp_input_path = input_path.encode()
+        cdef string cpp_output_path = output_path.encode()
+        cdef string cpp_delim = delim.encode('utf-8')
+        cdef bool cpp_unigram = unigram
+        cdef unsigned cpp_threads = threads
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.cut_viterbi_file(cpp_input_path, cpp_output_path, cpp_delim, cpp_unigram, cpp_threads)
+        finally:
+            self._end_read()
+
+    def log_prob_batch(self, texts, unigram=False):
+        # Log-probability of the best segmentation of every text (texts as in `cut`)
+        cdef vector[const char*] cpp_texts
+        cdef vector[size_t] lengths
+        views = _utf8_views(texts, cpp_texts, lengths)
+        cdef bool cpp_unigram = unigram
+        cdef vector[uint32_t] bounds
+        cdef vector[double] log_probs
+        cdef size_t k
+        self._begin_read()
+        try:
+            with nogil:
+                for k in range(cpp_texts.size()):
+                    log_probs.push_back(self.autom.cut_viterbi_bounds(cpp_texts[k], lengths[k], bounds, cpp_unigram))
+        finally:
+            self._end_read()
+        return list(log_probs)
 
-    def cut(self, text):
-        cdef vector[string] cpp_words = self.autom.cut(text.encode('utf-8'))
+    def lattice(self, text, unigram=False):
+        # Candidate words in CSR form (characters): the words ending at text[j] are
+        # k in [offsets[j], offsets[j + 1]), word k is text[start[k]:j + 1] with log-probability score[k].
+        # text as in `cut`, characters are those of its UTF-8
+        cdef const unsigned char[::1] view = _utf8_view(text)
+        cdef const char* data = _view_data(view)
+        cdef size_t n = view.shape[0]
+        cdef bool cpp_unigram = unigram
+        cdef Lattice lat
+        self._begin_read()
+        try:
+            with nogil:
+                lat = self.autom.lattice(data, n, cpp_unigram)
+        finally:
+            self._end_read()
+        return (np.array(lat.offsets, dtype=np.uint32),
+                np.array(lat.start, dtype=np.uint32),
+                np.array(lat.score, dtype=np.float64))
+
+    def cut_nbest(self, text, k, delim=None, unigram=False):
+        # The k best segmentations as (words, log-probability), best first. text as in `cut`
+        cdef const unsigned char[::1] view = _utf8_view(text)
+        cdef const char* data = _view_data(view)
+        cdef size_t n = view.shape[0]
+        cdef size_t cpp_k = k
+        cdef bool cpp_unigram = unigram
+        cdef vector[pair[vector[uint32_t], double]] cpp_res
+        self._begin_read()
+        try:
+            with nogil:
+                cpp_res = self.autom.cut_nbest_bounds(data, n, cpp_k, cpp_unigram)
+        finally:
+            self._end_read()
+        res = []
+        cdef size_t i
+        for i in range(cpp_res.size()):
+            words = _split_words(data, cpp_res[i].first)
+            res.append((delim.join(words) if delim is not None else words, cpp_res[i].second))
+        return res
+
+    def max_cut(self, text, delim=None, reverse=False):
+        # Forward (reverse=False) or backward maximum matching, text as in `cut`
+        cdef const unsigned char[::1] view = _utf8_view(text)
+        cdef const char* data = _view_data(view)
+        cdef size_t n = view.shape[0]
+        cdef bool cpp_reverse = reverse
+        cdef vector[uint32_t] bounds
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.max_cut_bounds(data, n, bounds, cpp_reverse)
+        finally:
+            self._end_read()
+        if delim is not None:
+            return _join_words(data, bounds, delim.encode('utf-8')).decode('utf-8')
+        return _split_words(data, bounds)
+
+    def max_cut_batch(self, texts, delim=" ", reverse=False):
+        # `max_cut` of every text (texts as in `cut`)
+        cdef vector[const char*] cpp_texts
+        cdef vector[size_t] lengths
+        views = _utf8_views(texts, cpp_texts, lengths)
+        cdef vector[vector[uint32_t]] bounds = vector[vector[uint32_t]](cpp_texts.size())
+        cdef bool cpp_reverse = reverse
+        cdef size_t k
+        self._begin_read()
+        try:
+            with nogil:
+                for k in range(cpp_texts.size()):
+                    self.autom.max_cut_bounds(cpp_texts[k], lengths[k], bounds[k], cpp_reverse)
+        finally:
+            self._end_read()
+        return _words_many(cpp_texts, bounds, delim)
+
+    def max_cut_file(self, input_path, output_path, delim=" ", reverse=False, threads=0):
+        cdef string cpp_input_path = input_path.encode()
+        cdef string cpp_output_path = output_path.encode()
+        cdef string cpp_delim = delim.encode('utf-8')
+        cdef bool cpp_reverse = reverse
+        cdef unsigned cpp_threads = threads
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.max_cut_file(cpp_input_path, cpp_output_path, cpp_delim, cpp_reverse, cpp_threads)
+        finally:
+            self._end_read()
+
+    def find_all(self, text, policy="overlapping"):
+        # (begin, end, word id) of the keyword occurrences, as byte offsets into the UTF-8 text (text as in `cut`).
+        # policy is "overlapping", "non_overlapping" or "leftmost_longest", the word id is a node id (get_node)
+        cdef const unsigned char[::1] view = _utf8_view(text)
+        cdef const char* data = _view_data(view)
+        cdef size_t n = view.shape[0]
+        cdef MatchPolicy cpp_policy = _match_policy(policy)
+        cdef vector[Match] matches
+        self._begin_read()
+        try:
+            with nogil:
+                matches = self.autom.find_all(data, n, cpp_policy)
+        finally:
+            self._end_read()
+        return [(match.begin, match.end, match.id) for match in matches]
+
+    def find_all_batch(self, texts, policy="overlapping"):
+        # `find_all` of every text (texts as in `cut`)
+        cdef vector[const char*] cpp_texts
+        cdef vector[size_t] lengths
+        views = _utf8_views(texts, cpp_texts, lengths)
+        cdef MatchPolicy cpp_policy = _match_policy(policy)
+        cdef vector[vector[Match]] matches
+        cdef size_t k
+        self._begin_read()
+        try:
+            with nogil:
+                for k in range(cpp_texts.size()):
+                    matches.push_back(self.autom.find_all(cpp_texts[k], lengths[k], cpp_policy))
+        finally:
+            self._end_read()
+        return [[(match.begin, match.end, match.id) for match in text_matches] for text_matches in matches]
+
+    def write_source(self, name, header_path, source_path):
+        # C++ header and source of automaton::<name>::cut with the tables compiled in, see scripts/gen_static_dict.py
+        cdef string cpp_name = name.encode()
+        cdef string cpp_header_path = header_path.encode()
+        cdef string cpp_source_path = source_path.encode()
+        self._begin_read()
+        try:
+            with nogil:
+                self.autom.write_source(cpp_name, cpp_header_path, cpp_source_path)
+        finally:
+            self._end_read()
+
+cdef class WordIterator:
+    # Iterator over the words of Automaton.words, the text is cut once up front
+    cdef const unsigned char[::1] view # The text, viewed by range
+    cdef WordRange range
+    cdef WordRange.iterator it # Next word of range
+    cdef size_t left # Words after it, included
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        if self.left == 0:
+            raise StopIteration
+        cdef uint32_t begin = self.it.begin()
+        cdef uint32_t end = self.it.end()
+        preincrement(self.it)
+        self.left -= 1
+        return PyUnicode_DecodeUTF8(_view_data(self.view) + begin, end - begin, NULL)
+
+    def __length_hint__(self):
+        return self.left
+
+cdef class StreamSegmenter:
+    cdef StreamSegmenterImpl* seg
+    cdef Automaton automaton # Keep the automaton alive while segmenting
+
+    def __cinit__(self, Automaton automaton):
+        automaton._check_not_writing()
+        self.automaton = automaton
+        self.seg = new StreamSegmenterImpl(automaton.autom[0])
+
+    def __dealloc__(self):
+        del self.seg
+
+    def feed(self, chunk):
+        # chunk is a str or a bytes-like object (as in `Automaton.cut`), the latter may split UTF-8 characters
+        cdef const unsigned char[::1] view = _utf8_view(chunk)
+        cdef const char* data = _view_data(view)
+        cdef size_t n = view.shape[0]
+        cdef vector[string] cpp_words
+        self.automaton._begin_read()
+        try:
+            with nogil:
+                cpp_words = self.seg.feed(data, n)
+        finally:
+            self.automaton._end_read()
         words = [word.decode('utf-8') for word in cpp_words]
-        return words
\ No newline at end of file
+        return words
+
+    def finish(self):
+        cdef vector[string] cpp_words
+        self.automaton._begin_read()
+        try:
+            with nogil:
+                cpp_words = self.seg.finish()
+        finally:
+            self.automaton._end_read()
+        words = [word.decode('utf-8') for word in cpp_words]
+        return words
+
+    def reset(self):
+        self.seg.reset()
@@ -4,10 +4,11 @@ from Cython.Build import cythonize
 ext_modules = [
     Extension(
         name="Automaton",
-        sources=["automaton.pyx", "src/automaton.cpp"],
+        sources=["automaton.pyx", "src/automaton.cpp", "src/stream_segmenter.cpp", "src/segmentation_cache.cpp"],
         language="c++",
         include_dirs=["."],
-        extra_compile_args=["-std=c++11", "-O2"],
+        extra_compile_args=["-std=c++11", "-O2", "-pthread"],
+        extra_link_args=["-pthread"],
     )
 ]
 
@@ -1,58 +1,306 @@
 #include "automaton.h"
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstring>
+#include <set>
+#include <atomic>
+#include <iomanip>
+#include <cctype>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace automaton {
 
-// Function to count the number of UTF-8 characters in a string
-// Returns INVALID_UTF8 (-1) if the string is not valid UTF-8
-static size_t count_utf8_chars(const std::string& s) {
-    size_t i = 0;
-    size_t count = 0;
-    const size_t len = s.size();
-
-    while (i < len) {
-        uint8_t byte = static_cast<uint8_t>(s[i]);
-
-        size_t char_len = 0;
-        if ((byte & 0x80) == 0x00) {
-            // 1-byte ASCII: 0xxxxxxx
-            char_len = 1;
-        } else if ((byte & 0xE0) == 0xC0) {
-            // 2-byte: 110xxxxx 10xxxxxx
-            char_len = 2;
-        } else if ((byte & 0xF0) == 0xE0) {
-            // 3-byte: 1110xxxx 10xxxxxx 10xxxxxx
-            char_len = 3;
-        } else if ((byte & 0xF8) == 0xF0) {
-            // 4-byte: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
-            char_len = 4;
-        } else {
-            return INVALID_UTF8;
+// Bytes of cut_file input handed to a worker at a time (rounded up to whole lines)
+static const size_t CUT_FILE_CHUNK = 1 << 20;
+
+// Texts whose boundaries cut_offsets holds at a time
+static const size_t CUT_OFFSETS_CHUNK = 1024;
+
+// Texts handed to a worker at a time by cut_bounds_many and cut_viterbi_bounds_many
+static const size_t SEGMENT_MANY_CHUNK = 256;
+
+// Header of Automaton::serialize, followed by the nodes, the best borders
+// and the side tables as (node, value) pairs of uint64_t
+struct SerializedHeader {
+    char magic[8];
+    uint32_t node_size, candidate_size; // Layout check, the arrays are copied as they are
+    uint32_t word_count, node_count, max_length, normalization;
+    uint64_t nodes, candidates, large_freqs, long_lengths;
+    uint64_t keyword_bytes[4];
+};
+
+static const char SERIALIZED_MAGIC[8] = {'L', 'L', 'A', 'C', 'A', 'A', 'C', '1'};
+
+// Generations are drawn from one counter, so cached results of different automata never mix
+static uint64_t next_generation() {
+    static std::atomic<uint64_t> counter(0);
+    return ++counter;
+}
+
+#if defined(__GNUC__)
+#define LLACA_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define LLACA_PREFETCH(p) ((void)0)
+#endif
+
+// Boundaries of the words on the best path, pre as computed by cut_dp
+static void trace_bounds(const std::vector<uint32_t>& utf8_start, const std::vector<int>& pre,
+                         std::vector<uint32_t>& bounds) {
+    bounds.clear();
+    for (int j = static_cast<int>(pre.size()) - 1; j >= 0; j = pre[j]) {
+        bounds.push_back(utf8_start[j + 1]);
+    }
+    bounds.push_back(0);
+
+    std::reverse(bounds.begin(), bounds.end());
+}
+
+// Words of text given its boundaries, word k is text[bounds[k], bounds[k + 1])
+static std::vector<std::string> split_words(const std::string& text, const std::vector<uint32_t>& bounds) {
+    std::vector<std::string> words;
+    for (size_t k = 0; k + 1 < bounds.size(); k++) {
+        words.push_back(text.substr(bounds[k], bounds[k + 1] - bounds[k]));
+    }
+    return words;
+}
+
+// Words of text given its boundaries, joined by delim
+static std::string join_words(const std::string& text, const std::vector<uint32_t>& bounds,
+                              const std::string& delim) {
+    std::string res;
+    res.reserve(text.size() * 2);
+    for (size_t k = 0; k + 1 < bounds.size(); k++) {
+        if (k) {
+            res += delim;
+        }
+        res.append(text, bounds[k], bounds[k + 1] - bounds[k]);
+    }
+    return res;
+}
+
+// Read-only view of a whole file, memory-mapped where available
+class MappedFile {
+private:
+    const char* _data;
+    size_t _size;
+    std::string _buffer; // Fallback when the file cannot be mapped
+
+public:
+    explicit MappedFile(const std::string& path) : _data(nullptr), _size(0) {
+#ifndef _WIN32
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open file: " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                _data = static_cast<const char*>(p);
+                _size = st.st_size;
+                madvise(p, _size, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+        if (_data) {
+            return;
+        }
+#endif
+        std::ifstream fin(path, std::ifstream::in | std::ifstream::binary);
+        if (!fin.is_open()) {
+            throw std::runtime_error("Failed to open file: " + path);
+        }
+        std::ostringstream oss;
+        oss << fin.rdbuf();
+        _buffer = oss.str();
+        _size = _buffer.size();
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (_buffer.empty() && _data) {
+            munmap(const_cast<char*>(_data), _size);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const {
+        return _data ? _data : _buffer.data();
+    }
+
+    size_t size() const {
+        return _size;
+    }
+};
+
+// Calls visit(keyword, freq) for each line of a dictionary file
+template <class Visit>
+static void read_dict(const std::string& dict_path, Visit&& visit) {
+    std::ifstream fin;
+    std::string line;
+    std::string keyword;
+    uint64_t freq;
+
+    fin.open(dict_path, std::ifstream::in);
+    if (!fin.is_open()) {
+        throw std::runtime_error("Failed to open dictionary file: " + dict_path);
+    }
+    
+    while (std::getline(fin, line)) {
+        // Each line contains a keyword, frequency (default 1 if not present), and part of speech (optional), separated by spaces
+        std::istringstream iss(line);
+        iss >> keyword;
+        if (!(iss >> freq)) {
+            freq = 1;
+        }
+        visit(keyword, freq);
+    }
+}
+
+// Distinct keyword of dictionary files, as insert stores it
+struct DictEntry {
+    std::string keyword; // Normalized
+    uint64_t freq; // Summed over its lines
+    size_t length; // UTF-8 characters
+    size_t order; // Line it first appears on, over all the files
+};
+
+// Distinct keywords of dictionary files sorted by keyword,
+// shared[k] is the number of nibbles entry k has in common with entry k - 1 (0 for the first)
+static void read_entries(const std::vector<std::string>& dict_paths, const normalize::Table& normalize,
+                         std::vector<DictEntry>& entries, std::vector<size_t>& shared) {
+    std::vector<DictEntry> lines;
+    for (const auto& dict_path : dict_paths) {
+        read_dict(dict_path, [&](const std::string& keyword, uint64_t freq) {
+            auto length = utf8::count_chars(keyword.data(), keyword.size());
+            if (length == utf8::INVALID) {
+                throw std::invalid_argument("Invalid UTF-8 string at byte " +
+                                            std::to_string(utf8::invalid_offset(keyword.data(), keyword.size())));
+            }
+            lines.push_back({normalize.flags() ? normalize.apply(keyword) : keyword, freq, length, lines.size()});
+        });
+    }
+    std::sort(lines.begin(), lines.end(), [](const DictEntry& a, const DictEntry& b) {
+        return a.keyword != b.keyword ? a.keyword < b.keyword : a.order < b.order;
+    });
+
+    entries.clear();
+    shared.clear();
+    for (auto& line : lines) {
+        if (!entries.empty() && entries.back().keyword == line.keyword) {
+            auto& entry = entries.back();
+            if (entry.freq + line.freq < line.freq) {
+                throw std::overflow_error("Frequency overflow");
+            }
+            entry.freq += line.freq;
+            continue;
+        }
+        size_t prefix = 0;
+        if (!entries.empty()) {
+            const auto& last = entries.back().keyword;
+            size_t k = 0;
+            while (k < last.size() && k < line.keyword.size() && last[k] == line.keyword[k]) {
+                k++;
+            }
+            prefix = 2 * k;
+            if (k < last.size() && k < line.keyword.size() &&
+                static_cast<uint8_t>(last[k]) >> OFFSET == static_cast<uint8_t>(line.keyword[k]) >> OFFSET) {
+                prefix++; // The bytes differ in the lower nibble only
+            }
+        }
+        shared.push_back(prefix);
+        entries.push_back(std::move(line));
+    }
+}
+
+// MemoryEstimate of an automaton holding the entries k with kept[k] set
+static MemoryEstimate estimate_kept(const std::vector<DictEntry>& entries, const std::vector<size_t>& shared,
+                                    const std::vector<bool>& kept) {
+    MemoryEstimate res = {};
+    uint64_t large_freqs = 0, long_lengths = 0;
+    size_t max_length = 0;
+
+    // A node per nibble, but for the prefix shared with the last kept keyword (in sorted order), whose nodes exist
+    res.nodes = 1;
+    size_t prefix = 0;
+    for (size_t k = 0; k < entries.size(); k++) {
+        prefix = std::min(prefix, shared[k]);
+        if (!kept[k]) {
+            continue;
         }
+        const auto& entry = entries[k];
+        res.words++;
+        res.nodes += 2 * entry.keyword.size() - prefix;
+        large_freqs += entry.freq >= PACKED_FREQ;
+        long_lengths += entry.length >= PACKED_LENGTH;
+        max_length = std::max(max_length, entry.length);
+        prefix = 2 * entry.keyword.size();
+    }
 
-        i += char_len;
-        ++count;
+    uint64_t side = large_freqs * (sizeof(uint32_t) + sizeof(uint64_t)) + long_lengths * 2 * sizeof(uint32_t);
+    uint64_t built = res.nodes * (sizeof(Node) + sizeof(Candidate));
+    res.built_bytes = sizeof(Automaton) + built + side;
+
+    // While inserting, the node vector doubles from INIT_SIZE (the old and new ones are held while it grows),
+    // then build() shrinks it to fit and adds the best borders
+    uint64_t capacity = INIT_SIZE;
+    while (capacity < res.nodes) {
+        capacity <<= 1;
     }
+    auto growing = capacity > INIT_SIZE ? capacity + capacity / 2 : capacity;
+    auto shrinking = capacity > res.nodes ? capacity + res.nodes : capacity;
+    res.peak_bytes = sizeof(Automaton) + side + std::max(std::max(growing, shrinking) * sizeof(Node), built);
+
+    res.image_bytes = sizeof(SerializedHeader) + built + 2 * (large_freqs + long_lengths) * sizeof(uint64_t);
 
-    return count;
+    // Narrowest state and length types, as chosen by write_source
+    uint64_t state_size = res.nodes <= (1u << 8) ? 1 : res.nodes <= (1u << 16) ? 2 : 4;
+    uint64_t length_size = max_length < (1u << 8) ? 1 : max_length < (1u << 16) ? 2 : 4;
+    res.static_bytes = 4 * sizeof(uint64_t) + res.nodes * (SIZE * state_size + sizeof(float) + length_size);
+    return res;
 }
 
 size_t Automaton::memory_usage() const {
     size_t total = 0;
     total += sizeof(*this);
     total += t.capacity() * sizeof(Node);
+    total += best.capacity() * sizeof(Candidate);
+    total += _large_freq.size() * (sizeof(uint32_t) + sizeof(uint64_t));
+    total += _long_length.size() * 2 * sizeof(uint32_t);
     return total;
 }
 
-void Automaton::insert(const std::string& s, uint32_t freq) {
-    auto length = count_utf8_chars(s);
+void Automaton::insert(const std::string& s, uint64_t freq) {
+    auto length = utf8::count_chars(s.data(), s.size());
+
+    if (length == utf8::INVALID) {
+        throw std::invalid_argument("Invalid UTF-8 string at byte " +
+                                    std::to_string(utf8::invalid_offset(s.data(), s.size())));
+    }
 
-    if (length == INVALID_UTF8) {
-        throw std::invalid_argument("Invalid UTF-8 string: " + s);
+    std::string normalized;
+    if (_normalize.flags()) {
+        normalized = _normalize.apply(s);
     }
+    const auto& keyword = _normalize.flags() ? normalized : s;
 
     auto u = ROOT;
 
-    for (uint8_t byte : s) {
+    for (uint8_t byte : keyword) {
+        _keyword_bytes.set(byte);
+
         uint8_t half_byte = byte >> OFFSET; // Upper 4 bits
 
         if (!t[u].ch[half_byte] || t[t[u].ch[half_byte]].parent != u) {
@@ -72,32 +320,42 @@ void Automaton::insert(const std::string& s, uint32_t freq) {
         u = t[u].ch[half_byte]; // Move to the next state
     }
 
+    auto total = word_freq(u) + freq;
+    if (total < freq) {
+        throw std::overflow_error("Frequency overflow");
+    }
+
     if (t[u].end == 0) { // New keyword
         _word_count++;
     }
 
-    if (1ll * t[u].end + freq > MAX_FREQ) {
-        throw std::overflow_error("Frequency overflow");
+    // Values out of the packed range go to the side tables
+    if (total >= PACKED_FREQ) {
+        t[u].end = PACKED_FREQ;
+        _large_freq[u] = total;
+    } else {
+        t[u].end = total;
     }
-
-    if (length > MAX_UTF8_LEN) {
-        throw std::overflow_error("UTF-8 length overflow");
+    if (length >= PACKED_LENGTH) {
+        t[u].length = PACKED_LENGTH;
+        _long_length[u] = length;
+    } else {
+        t[u].length = length;
     }
-
-    t[u].end += freq;
-    t[u].length = length;
+    _max_length = std::max<uint32_t>(_max_length, length);
 }
 
 void Automaton::get_trie_sum() {
     // Initialize prefix sum
-    for (auto& node : t) {
-        node.trie_sum = node.end;
+    for (uint32_t i = 0; i <= _node_count; i++) {
+        t[i].trie_sum = word_freq(i);
     }
 
     // Update the Trie from bottom to top
     for (auto i = _node_count; i >= 0; i--) {
-        t[t[i].parent].trie_sum += t[i].trie_sum;
-        t[i].log_end = log2(t[i].end);
+        auto& sum = t[t[i].parent].trie_sum;
+        sum = sum + t[i].trie_sum < sum ? std::numeric_limits<uint64_t>::max() : sum + t[i].trie_sum; // Saturate
+        t[i].log_end = log2(word_freq(i));
         t[i].log_trie_sum = log2(t[i].trie_sum);
         if (i == 0) break; // Avoid underflow
     }
@@ -128,32 +386,297 @@ void Automaton::get_fail() {
     }
 }
 
+void Automaton::get_start_bytes() {
+    _start_bytes.reset();
+    for (int b = 0; b < 0x80; b++) {
+        char c = b;
+        if (next_state(ROOT, &c, 1) != ROOT) {
+            _start_bytes.set(b);
+        }
+    }
+}
+
+void Automaton::get_best() {
+    best.assign(t.size(), {-std::numeric_limits<float>::infinity(), 0});
+
+    // Breadth-first, so the (shorter) fail state of a node is done before the node
+    std::queue<uint32_t> q;
+    q.push(ROOT);
+
+    while (!q.empty()) {
+        auto u = q.front();
+        q.pop();
+        for (uint32_t i = 0; i < SIZE; i++) {
+            auto v = t[u].ch[i];
+            if (v && t[v].parent == u) {
+                q.push(v);
+            }
+        }
+
+        if (u == ROOT) {
+            continue;
+        }
+
+        // Borders of u are u itself (if it is an end state) followed by the borders of its fail state
+        best[u] = best[t[u].fail];
+        if (t[u].end != 0) {
+            auto prob = t[u].log_end - t[t[u].pre].log_trie_sum;
+            if (prob >= best[u].prob) { // Ties go to the longer keyword, which comes first among the borders
+                best[u] = {prob, word_length(u)};
+            }
+        }
+    }
+}
+
+void Automaton::check_built() const {
+    if (best.size() != t.size()) {
+        throw std::runtime_error("Automaton is not built");
+    }
+}
+
 void Automaton::load_dict(const std::string& dict_path) {
-    std::ifstream fin;
-    std::string line;
-    std::string keyword;
-    uint32_t freq;
+    read_dict(dict_path, [this](const std::string& keyword, uint64_t freq) {
+        insert(keyword, freq);
+    });
+}
 
-    fin.open(dict_path, std::ifstream::in);
-    if (!fin.is_open()) {
-        throw std::runtime_error("Failed to open dictionary file: " + dict_path);
+std::string Automaton::serialize() const {
+    SerializedHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SERIALIZED_MAGIC, sizeof(header.magic));
+    header.node_size = sizeof(Node);
+    header.candidate_size = sizeof(Candidate);
+    header.word_count = _word_count;
+    header.node_count = _node_count;
+    header.max_length = _max_length;
+    header.normalization = _normalize.flags();
+    header.nodes = t.size();
+    header.candidates = best.size();
+    header.large_freqs = _large_freq.size();
+    header.long_lengths = _long_length.size();
+    for (int b = 0; b < 256; b++) {
+        if (_keyword_bytes[b]) {
+            header.keyword_bytes[b >> 6] |= uint64_t(1) << (b & 63);
+        }
     }
-    
-    while (std::getline(fin, line)) {
-        // Each line contains a keyword, frequency (default 1 if not present), and part of speech (optional), separated by spaces
-        std::istringstream iss(line);
-        iss >> keyword;
-        if (!(iss >> freq)) {
-            freq = 1;
+
+    std::vector<uint64_t> side;
+    for (const auto& entry : _large_freq) {
+        side.push_back(entry.first);
+        side.push_back(entry.second);
+    }
+    for (const auto& entry : _long_length) {
+        side.push_back(entry.first);
+        side.push_back(entry.second);
+    }
+
+    std::string res;
+    res.reserve(sizeof(header) + t.size() * sizeof(Node) + best.size() * sizeof(Candidate) +
+                side.size() * sizeof(uint64_t));
+    res.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    res.append(reinterpret_cast<const char*>(t.data()), t.size() * sizeof(Node));
+    res.append(reinterpret_cast<const char*>(best.data()), best.size() * sizeof(Candidate));
+    res.append(reinterpret_cast<const char*>(side.data()), side.size() * sizeof(uint64_t));
+    return res;
+}
+
+// Whether nodes and candidates read from an image are what build() makes from their trie, so that cutting with
+// them stays inside the arrays: every link in range, the trie a tree, the transitions, fail links and best
+// borders as build sets them, and the keyword lengths those of the trie paths.
+// An image of an automaton not built since its last insert (fewer candidates than nodes) is not cut, only its
+// fail links are checked to lead to the root.
+static bool valid_image(const std::vector<Node>& t, const std::vector<Candidate>& best,
+                        const std::unordered_map<uint32_t, uint64_t>& large_freq,
+                        const std::unordered_map<uint32_t, uint32_t>& long_length,
+                        uint32_t word_count, uint32_t max_length) {
+    uint32_t nodes = t.size();
+    bool built = best.size() == t.size();
+
+    for (uint32_t u = 0; u < nodes; u++) {
+        const auto& node = t[u];
+        if (node.id != u || (u == ROOT ? node.parent != ROOT : node.parent >= u) ||
+            node.pre >= nodes || node.fail >= nodes ||
+            (node.end == PACKED_FREQ) != (large_freq.count(u) != 0) ||
+            (node.length == PACKED_LENGTH) != (long_length.count(u) != 0)) {
+            return false;
         }
-        insert(keyword, freq);
+        for (uint32_t i = 0; i < SIZE; i++) {
+            if (node.ch[i] >= nodes) {
+                return false;
+            }
+        }
+    }
+    for (const auto& entry : large_freq) {
+        if (entry.second < PACKED_FREQ) {
+            return false;
+        }
+    }
+    for (const auto& entry : long_length) {
+        if (entry.second < PACKED_LENGTH) {
+            return false;
+        }
+    }
+
+    // Breadth-first over the trie edges, with the depth of each node in nibbles and in UTF-8 characters and its
+    // fail state before build skips the states where no keyword ends
+    std::vector<uint32_t> order{ROOT}, depth(nodes, 0), chars(nodes, 0), fail(nodes, ROOT);
+    order.reserve(nodes);
+    for (size_t k = 0; k < order.size(); k++) {
+        auto u = order[k];
+        for (uint32_t i = 0; i < SIZE; i++) {
+            auto v = t[u].ch[i];
+            auto fallback = u == ROOT ? ROOT : t[fail[u]].ch[i];
+            if (v != ROOT && t[v].parent == u) {
+                if (depth[v] != 0) { // Reached twice
+                    return false;
+                }
+                depth[v] = depth[u] + 1;
+                chars[v] = chars[u] + (depth[u] % 2 == 0 && (i < 0x8 || i > 0xB)); // Not a continuation byte
+                fail[v] = fallback;
+                order.push_back(v);
+            } else if (built && v != fallback) {
+                return false;
+            }
+        }
+    }
+    if (order.size() != nodes) {
+        return false;
+    }
+
+    uint32_t ends = 0, longest = 0;
+    for (auto v : order) {
+        const auto& node = t[v];
+        uint32_t length = 0;
+        if (node.end == 0) {
+            if (node.length != 0) {
+                return false;
+            }
+        } else {
+            length = node.length != PACKED_LENGTH ? node.length : long_length.at(v);
+            if (depth[v] % 2 != 0 || length != chars[v]) {
+                return false;
+            }
+            ends++;
+            longest = std::max(longest, length);
+        }
+
+        if (!built) {
+            if (v != ROOT ? depth[node.fail] >= depth[v] : node.fail != ROOT) {
+                return false;
+            }
+            continue;
+        }
+
+        // Fail links skip to the nearest state where a keyword ends, see build. The best border is the state's
+        // own keyword or the best border of its fail state, as in get_best
+        if (v != ROOT && fail[v] != ROOT && t[fail[v]].end == 0) {
+            fail[v] = t[fail[v]].fail;
+        }
+        if (node.fail != fail[v]) {
+            return false;
+        }
+        auto best_length = best[v].length;
+        if (v == ROOT ? best_length != 0
+                      : best_length != best[node.fail].length && (node.end == 0 || best_length != length)) {
+            return false;
+        }
+    }
+    return ends == word_count && longest == max_length;
+}
+
+void Automaton::deserialize(const char* data, size_t n) {
+    SerializedHeader header;
+    if (n < sizeof(header)) {
+        throw std::invalid_argument("Invalid serialized automaton");
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SERIALIZED_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::invalid_argument("Invalid serialized automaton");
+    }
+    if (header.node_size != sizeof(Node) || header.candidate_size != sizeof(Candidate)) {
+        throw std::invalid_argument("Serialized automaton from an incompatible build");
+    }
+    if (header.nodes != uint64_t(header.node_count) + 1 || header.candidates > header.nodes ||
+        header.large_freqs > header.nodes || header.long_lengths > header.nodes ||
+        n - sizeof(header) < header.nodes * sizeof(Node) + header.candidates * sizeof(Candidate) +
+                             2 * (header.large_freqs + header.long_lengths) * sizeof(uint64_t)) {
+        throw std::invalid_argument("Invalid serialized automaton");
+    }
+
+    data += sizeof(header);
+    std::vector<Node> new_t(header.nodes);
+    memcpy(new_t.data(), data, header.nodes * sizeof(Node));
+    data += header.nodes * sizeof(Node);
+    std::vector<Candidate> new_best(header.candidates);
+    memcpy(new_best.data(), data, header.candidates * sizeof(Candidate));
+    data += header.candidates * sizeof(Candidate);
+
+    std::vector<uint64_t> side(2 * (header.large_freqs + header.long_lengths));
+    if (!side.empty()) {
+        memcpy(side.data(), data, side.size() * sizeof(uint64_t));
+    }
+    std::unordered_map<uint32_t, uint64_t> new_large_freq;
+    std::unordered_map<uint32_t, uint32_t> new_long_length;
+    for (size_t k = 0; k < side.size(); k += 2) {
+        if (side[k] >= header.nodes) {
+            throw std::invalid_argument("Invalid serialized automaton");
+        }
+        if (k < 2 * header.large_freqs) {
+            new_large_freq[side[k]] = side[k + 1];
+        } else if (side[k + 1] <= std::numeric_limits<uint32_t>::max()) {
+            new_long_length[side[k]] = side[k + 1];
+        } else {
+            throw std::invalid_argument("Invalid serialized automaton");
+        }
+    }
+
+    if (!valid_image(new_t, new_best, new_large_freq, new_long_length, header.word_count, header.max_length)) {
+        throw std::invalid_argument("Invalid serialized automaton");
+    }
+
+    t.swap(new_t);
+    best.swap(new_best);
+    _large_freq.swap(new_large_freq);
+    _long_length.swap(new_long_length);
+    _word_count = header.word_count;
+    _node_count = header.node_count;
+    _max_length = header.max_length;
+    _normalize = normalize::Table(header.normalization);
+    _keyword_bytes.reset();
+    for (int b = 0; b < 256; b++) {
+        if (header.keyword_bytes[b >> 6] >> (b & 63) & 1) {
+            _keyword_bytes.set(b);
+        }
+    }
+    get_start_bytes();
+    _cur_state = ROOT;
+    _generation = next_generation();
+}
+
+void Automaton::set_normalization(uint8_t flags) {
+    if (_word_count != 0) {
+        throw std::runtime_error("Normalization must be set before inserting keywords");
     }
+    _normalize = normalize::Table(flags);
+}
+
+uint8_t Automaton::normalization() const {
+    return _normalize.flags();
 }
 
 void Automaton::build() {
     // Shrink the vector to fit the actual size
     t.shrink_to_fit();
 
+    // ASCII bytes normalizing to a keyword byte cannot take the non-keyword shortcuts either
+    for (int b = 0; b < 0x80; b++) {
+        char c = b;
+        auto norm = _normalize(&c, 1);
+        if (norm && _keyword_bytes[norm]) {
+            _keyword_bytes.set(b);
+        }
+    }
+
     get_trie_sum();
 
     for (uint32_t i = 1; i <= _node_count; i++) {
@@ -173,6 +696,11 @@ void Automaton::build() {
         }
         t[i].fail = pre;
     }
+
+    get_best();
+    get_start_bytes();
+
+    _generation = next_generation();
 }
 
 void Automaton::build(const std::string& dict_path) {
@@ -187,18 +715,112 @@ void Automaton::build(const std::vector<std::string>& dict_paths) {
     build();
 }
 
+std::vector<std::pair<std::string, uint64_t>> Automaton::build(const std::vector<std::string>& dict_paths,
+                                                               size_t max_bytes) {
+    if (_word_count != 0) {
+        throw std::runtime_error("A memory budget needs an empty automaton");
+    }
+
+    std::vector<DictEntry> entries;
+    std::vector<size_t> shared;
+    read_entries(dict_paths, _normalize, entries, shared);
+
+    // Entries in the order they are left out
+    std::vector<size_t> drop(entries.size());
+    for (size_t k = 0; k < drop.size(); k++) {
+        drop[k] = k;
+    }
+    std::sort(drop.begin(), drop.end(), [&entries](size_t a, size_t b) {
+        if (entries[a].freq != entries[b].freq) {
+            return entries[a].freq < entries[b].freq;
+        }
+        if (entries[a].keyword.size() != entries[b].keyword.size()) {
+            return entries[a].keyword.size() > entries[b].keyword.size();
+        }
+        return a < b;
+    });
+
+    std::vector<bool> kept(entries.size());
+    auto estimate_without = [&](size_t count) {
+        std::fill(kept.begin(), kept.end(), true);
+        for (size_t k = 0; k < count; k++) {
+            kept[drop[k]] = false;
+        }
+        return estimate_kept(entries, shared, kept);
+    };
+
+    if (estimate_without(entries.size()).built_bytes > max_bytes) {
+        throw std::runtime_error("Memory budget of " + std::to_string(max_bytes) +
+                                 " bytes is below the size of an empty automaton");
+    }
+
+    // Leaving out more keywords never adds nodes, so search for the fewest to leave out
+    size_t lo = 0, hi = entries.size();
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        if (estimate_without(mid).built_bytes <= max_bytes) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    auto est = estimate_without(lo);
+
+    std::vector<std::pair<std::string, uint64_t>> dropped;
+    for (size_t k = 0; k < lo; k++) {
+        dropped.emplace_back(entries[drop[k]].keyword, entries[drop[k]].freq);
+    }
+
+    // Insert in the order of the files, so node ids are those of build(dict_paths) if nothing is left out
+    std::vector<size_t> order;
+    for (size_t k = 0; k < entries.size(); k++) {
+        if (kept[k]) {
+            order.push_back(k);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&entries](size_t a, size_t b) {
+        return entries[a].order < entries[b].order;
+    });
+
+    // Exactly the estimated nodes, not the INIT_SIZE the constructor reserved, which may exceed a small budget
+    std::vector<Node>(t.begin(), t.end()).swap(t);
+    t.reserve(est.nodes);
+    for (auto k : order) {
+        insert(entries[k].keyword, entries[k].freq);
+    }
+    build();
+
+    if (memory_usage() > max_bytes) {
+        throw std::runtime_error("Automaton of " + std::to_string(memory_usage()) +
+                                 " bytes exceeds the memory budget of " + std::to_string(max_bytes) + " bytes");
+    }
+    return dropped;
+}
+
+MemoryEstimate Automaton::estimate(const std::vector<std::string>& dict_paths, uint8_t normalization) {
+    std::vector<DictEntry> entries;
+    std::vector<size_t> shared;
+    read_entries(dict_paths, normalize::Table(normalization), entries, shared);
+    return estimate_kept(entries, shared, std::vector<bool>(entries.size(), true));
+}
+
 Automaton::Automaton() {
     _word_count = 0;
     _node_count = 0;
     _cur_state = ROOT;
+    _max_length = 0;
     t.reserve(INIT_SIZE);
     t.emplace_back(ROOT);
+    get_best();
+    get_start_bytes();
+    _generation = next_generation();
 }
 
 Automaton::Automaton(const std::string& dict_path) {
     _word_count = 0;
     _node_count = 0;
     _cur_state = ROOT;
+    _max_length = 0;
     t.reserve(INIT_SIZE);
     t.emplace_back(ROOT);
     build(dict_path);
@@ -208,6 +830,7 @@ Automaton::Automaton(const std::vector<std::string>& dict_paths) {
     _word_count = 0;
     _node_count = 0;
     _cur_state = ROOT;
+    _max_length = 0;
     t.reserve(INIT_SIZE);
     t.emplace_back(ROOT);
     build(dict_paths);
@@ -217,6 +840,10 @@ uint32_t Automaton::word_count() const {
     return _word_count;
 }
 
+uint32_t Automaton::max_length() const {
+    return _max_length;
+}
+
 Node Automaton::get_node(uint32_t node_id) const {
     if (node_id >= t.size()) {
         throw std::out_of_range("Node ID out of range");
@@ -224,7 +851,39 @@ Node Automaton::get_node(uint32_t node_id) const {
     return t[node_id];
 }
 
-std::vector<Node> Automaton::get_borders(uint32_t node_id) {
+uint32_t Automaton::node_count() const {
+    return t.size();
+}
+
+// Copies field(node) of every node into column, unless it is null
+template <class T, class Field>
+static void copy_column(const std::vector<Node>& t, T* column, Field field) {
+    if (!column) {
+        return;
+    }
+    for (size_t u = 0; u < t.size(); u++) {
+        column[u] = field(t[u]);
+    }
+}
+
+void Automaton::node_table(uint64_t* end, uint32_t* length, uint32_t* parent, uint32_t* pre, uint32_t* fail,
+                           float* log_end, float* log_trie_sum, uint64_t* trie_sum, uint32_t* ch) const {
+    copy_column(t, end, [this](const Node& node) { return word_freq(node.id); });
+    copy_column(t, length, [this](const Node& node) { return word_length(node.id); });
+    copy_column(t, parent, [](const Node& node) { return node.parent; });
+    copy_column(t, pre, [](const Node& node) { return node.pre; });
+    copy_column(t, fail, [](const Node& node) { return node.fail; });
+    copy_column(t, log_end, [](const Node& node) { return node.log_end; });
+    copy_column(t, log_trie_sum, [](const Node& node) { return node.log_trie_sum; });
+    copy_column(t, trie_sum, [](const Node& node) { return node.trie_sum; });
+    if (ch) {
+        for (size_t u = 0; u < t.size(); u++) {
+            std::copy(t[u].ch, t[u].ch + SIZE, ch + u * SIZE);
+        }
+    }
+}
+
+std::vector<Node> Automaton::get_borders(uint32_t node_id) const {
     std::vector<Node> borders;
     Node unode = get_node(node_id);
     while (unode.id != ROOT) {
@@ -260,146 +919,1227 @@ Node Automaton::trans_byte(uint8_t byte) {
     return t[u];
 }
 
+void Automaton::trans(size_t n, const uint32_t* states, const uint8_t* bytes, uint32_t* out) const {
+    for (size_t i = 0; i < n; i++) {
+        auto u = states[i];
+        if (u >= t.size()) {
+            throw std::out_of_range("Node ID out of range");
+        }
+        u = t[u].ch[bytes[i] >> OFFSET];
+        out[i] = t[u].ch[bytes[i] & MASK];
+    }
+}
+
+void Automaton::trans_text(const char* text, size_t n, uint32_t state, uint32_t* out) const {
+    if (state >= t.size()) {
+        throw std::out_of_range("Node ID out of range");
+    }
+    for (size_t i = 0; i < n; i++) {
+        uint8_t byte = static_cast<uint8_t>(text[i]);
+        state = t[state].ch[byte >> OFFSET];
+        state = t[state].ch[byte & MASK];
+        out[i] = state;
+    }
+}
+
 void Automaton::reset(uint32_t new_state) {
     _cur_state = new_state;
 }
 
-std::vector<std::string> Automaton::cut(const std::string& text, bool cut_all) {
-    if (text.empty()) {
-        return {};
+uint32_t Automaton::next_state(uint32_t state, const char* s, uint8_t char_len) const {
+    char norm = _normalize(s, char_len);
+    if (norm) {
+        s = &norm;
+        char_len = 1;
     }
+    if (char_len == 1 && !_keyword_bytes[static_cast<uint8_t>(s[0])]) {
+        return ROOT;
+    }
+    for (uint8_t k = 0; k < char_len; k++) {
+        uint8_t byte = static_cast<uint8_t>(s[k]);
+        state = t[state].ch[byte >> OFFSET];
+        state = t[state].ch[byte & MASK];
+    }
+    return state;
+}
 
-    auto n = text.size();
-    auto min_prob = -get_node(0).log_trie_sum;
+uint8_t Automaton::classify(const char* s, uint8_t char_len) const {
+    char norm = _normalize(s, char_len);
+    return norm ? pretokenize::classify(&norm, 1) : pretokenize::classify(s, char_len);
+}
 
-    std::vector<float> max_prob; // char
-    std::vector<int> utf8_start; // byte
-    std::vector<int> pre; // char
-    std::vector<std::string> words;
+void Automaton::char_starts(const char* text, size_t n, std::vector<uint32_t>& utf8_start) const {
+    utf8_start.clear();
+    if (!utf8::char_starts(text, n, utf8_start)) {
+        // The offset only: the text may be large, and its bytes would not decode on the Python side either
+        throw std::invalid_argument("Invalid UTF-8 string at byte " + std::to_string(utf8::invalid_offset(text, n)));
+    }
+    utf8_start.push_back(n);
+}
 
-    int i = 0, j = 0; // byte, char
+template <class Visit>
+void Automaton::for_each_edge(const char* text, const std::vector<uint32_t>& utf8_start, bool unigram,
+                              Visit&& visit) const {
+    double min_prob = -t[ROOT].log_trie_sum;
+    int m = utf8_start.size() - 1;
 
-    auto pre_state = _cur_state;
+    std::vector<uint8_t> cls(m + 2, 0);
+    for (int j = 0; j < m; j++) {
+        cls[j] = classify(text + utf8_start[j], utf8_start[j + 1] - utf8_start[j]);
+    }
 
-    _cur_state = ROOT;
-    
-    // TODO: Handle full-width numbers and alphabets
-    int num_start = -1, alpha_start = -1; // char, char
+    auto state = ROOT;
+    pretokenize::NumberRule number;
+    pretokenize::AlphaRule alpha;
 
-    auto collect_word = [&words, &text](int utf8_start, int utf8_len) {
-        words.push_back(text.substr(utf8_start, utf8_len));
-    };
-    
-    while (i < n) {
-        uint8_t byte = static_cast<uint8_t>(text[i]);
-        uint8_t char_len = 0;
-        if ((byte & 0x80) == 0x00) {
-            // 1-byte ASCII: 0xxxxxxx
-            char_len = 1;
-        } else if ((byte & 0xE0) == 0xC0) {
-            // 2-byte: 110xxxxx 10xxxxxx
-            char_len = 2;
-        } else if ((byte & 0xF0) == 0xE0) {
-            // 3-byte: 1110xxxx 10xxxxxx 10xxxxxx
-            char_len = 3;
-        } else if ((byte & 0xF8) == 0xF0) {
-            // 4-byte: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
-            char_len = 4;
-        } else {
-            _cur_state = pre_state; // Restore previous state
-            throw std::invalid_argument("Invalid UTF-8 string: " + text);
-        }
+    for (int j = 0; j < m; j++) {
+        state = next_state(state, text + utf8_start[j], utf8_start[j + 1] - utf8_start[j]);
 
-        if (i + char_len > n) {
-            _cur_state = pre_state; // Restore previous state
-            throw std::invalid_argument("Invalid UTF-8 string: " + text);
+        visit(j, j - 1, cls[j] & char_class::SYMBOL ? min_prob / 2 : min_prob);
+
+        auto span = number.step(j, cls[j], cls[j + 1], cls[j + 2]);
+        if (span != -1) {
+            visit(j, static_cast<int>(span) - 1, min_prob / 4);
         }
-        
-        for (uint8_t k = 0; k < char_len; k++) {
-            trans_byte(static_cast<uint8_t>(text[i + k]));
+        span = alpha.step(j, cls[j], cls[j + 1], cls[j + 2]);
+        if (span != -1) {
+            visit(j, static_cast<int>(span) - 1, min_prob / 2);
         }
 
-        max_prob.push_back(min_prob);
-        pre.push_back(j - 1);
-        utf8_start.push_back(i);
-
-        // Handle numbers
-        if (char_len == 1 && isdigit(text[i])) {
-            if (num_start == -1) { // First number
-                num_start = j;
-            } else { // Not the first number
-                // [0, num_start) [num_start, j) vs [0, j - 1) [j - 1, j)
-                // NOTE: min_prob is negative
-                if (max_prob[num_start - 1] + min_prob / 2 > max_prob.back() + min_prob) {
-                    max_prob.back() = max_prob[num_start - 1] + min_prob / 2;
-                    pre.back() = num_start - 1;
-                }
+        for (auto v = state; v != ROOT; v = t[v].fail) {
+            if (t[v].end == 0) {
+                continue;
             }
-        } else { // Clear num_start
-            num_start = -1;
+            double log_pre = unigram ? -min_prob : t[t[v].pre].log_trie_sum;
+            visit(j, j - static_cast<int>(word_length(v)), t[v].log_end - log_pre);
         }
+    }
+}
+
+void Automaton::cut_dp(const char* text, const std::vector<uint32_t>& utf8_start, std::vector<int>& pre,
+                       std::vector<uint32_t>* spans, const uint32_t* states) const {
+    check_built();
+
+    auto min_prob = -get_node(0).log_trie_sum;
+    size_t n = utf8_start.back();
+
+    std::vector<float> max_prob; // char
+    pre.clear();
+
+    int m = utf8_start.size() - 1; // Number of characters
+    max_prob.reserve(m);
+    pre.reserve(m);
 
-        // Handle alphabets
-        if (char_len == 1 && isalpha(text[i])) {
-            if (alpha_start == -1) { // First alpha
-                alpha_start = j;
-            } else { // Not the first alpha
-                // [0, alpha_start) [alpha_start, j) vs [0, j - 1) [j - 1, j)
-                // NOTE: min_prob is negative
-                if (max_prob[alpha_start - 1] + min_prob / 2 > max_prob.back() + min_prob) {
-                    max_prob.back() = max_prob[alpha_start - 1] + min_prob / 2;
-                    pre.back() = alpha_start - 1;
+    // Classes for the pre-tokenization rules, two empty ones past the end for the lookahead
+    std::vector<uint8_t> cls(m + 2, 0);
+    for (int j = 0; j < m; j++) {
+        cls[j] = classify(text + utf8_start[j], utf8_start[j + 1] - utf8_start[j]);
+    }
+
+    auto state = ROOT; // Local, so concurrent cuts do not share the automaton cursor
+    pretokenize::NumberRule number;
+    pretokenize::AlphaRule alpha;
+
+    bool cut_all = spans != nullptr;
+    auto collect_word = [spans](uint32_t begin, uint32_t end) {
+        spans->push_back(begin);
+        spans->push_back(end);
+    };
+    
+    int run_end = 0; // End of the ASCII digit/letter run around j, found once per run
+    
+    for (int j = 0; j < m; j++) {
+        auto i = utf8_start[j];
+        uint8_t char_len = utf8_start[j + 1] - i;
+        uint8_t byte = static_cast<uint8_t>(text[i]);
+
+        // In a run of ASCII digits/letters, a character no keyword starts with leaves the automaton at the root,
+        // so from there the characters up to the next such start skip the automaton. Only the default edge
+        // applies inside a run, a rule span can only end on its last character, which goes through the usual path.
+        if (char_len == 1 && (utf8::is_digit(byte) || utf8::is_alpha(byte))) {
+            if (j >= run_end) {
+                run_end = j + (utf8::is_digit(byte) ? utf8::ascii_run<false>(text + i, n - i)
+                                                    : utf8::ascii_run<true>(text + i, n - i));
+            }
+            if (state == ROOT && j < run_end - 1 && !_start_bytes[byte]) {
+                int skip_end = j + 1;
+                while (skip_end < run_end - 1 && !_start_bytes[static_cast<uint8_t>(text[i + skip_end - j])]) {
+                    skip_end++;
                 }
+
+                // Inside the run the rules at most open a span on its first character, the later steps change nothing
+                number.step(j, cls[j], cls[j + 1], cls[j + 2]);
+                alpha.step(j, cls[j], cls[j + 1], cls[j + 2]);
+                max_prob.resize(skip_end, min_prob);
+                for (int k = j; k < skip_end; k++) {
+                    pre.push_back(k - 1);
+                    if (cut_all) {
+                        collect_word(utf8_start[k], utf8_start[k] + 1);
+                    }
+                }
+                j = skip_end;
+                i = utf8_start[j];
+                byte = static_cast<uint8_t>(text[i]);
             }
-        } else { // Clear alpha_start
-            alpha_start = -1;
+        }
+        
+        state = states ? states[j] : next_state(state, text + i, char_len);
+
+        // Default edge, a single character
+        max_prob.push_back(cls[j] & char_class::SYMBOL ? min_prob / 2 : min_prob);
+        pre.push_back(j - 1);
+
+        // Number and English word spans ending here
+        // NOTE: min_prob is negative
+        auto span = number.step(j, cls[j], cls[j + 1], cls[j + 2]);
+        if (span != -1 && min_prob / 4 > max_prob.back()) {
+            max_prob.back() = min_prob / 4;
+            pre.back() = span - 1;
+        }
+        span = alpha.step(j, cls[j], cls[j + 1], cls[j + 2]);
+        if (span != -1 && min_prob / 2 > max_prob.back()) {
+            max_prob.back() = min_prob / 2;
+            pre.back() = span - 1;
         }
 
         if (cut_all) {
-            collect_word(utf8_start[pre.back() + 1], utf8_start.back() + char_len - utf8_start[pre.back() + 1]);
+            collect_word(utf8_start[pre.back() + 1], utf8_start[j + 1]);
+
+            // Every keyword ending here
+            for (auto v = state; v != ROOT; v = t[v].fail) {
+                auto len_border = word_length(v);
+                if (t[v].end != 0 && len_border != 1) {
+                    collect_word(utf8_start[j - len_border + 1], utf8_start[j + 1]);
+                }
+            }
         }
 
-        auto borders = get_borders(_cur_state);
+        // Best keyword ending here
+        const auto& candidate = best[state];
+        if (candidate.prob > max_prob.back()) {
+            max_prob.back() = candidate.prob;
+            pre.back() = j - candidate.length;
+        }
+    }
+}
+
+void Automaton::cut_bounds(const char* text, size_t n, std::vector<uint32_t>& bounds) const {
+    check_built();
+    bounds.clear();
+    if (n == 0) {
+        return;
+    }
 
-        for (const auto& border : borders) {
-            if (border.end == 0) {
+    std::vector<uint32_t> utf8_start;
+    char_starts(text, n, utf8_start); // Invalid UTF-8 throws before the cache is consulted
+    auto cache = this->cache();
+    if (cache && cache->lookup(text, n, _generation, bounds)) {
+        return;
+    }
+
+    std::vector<int> pre;
+    cut_dp(text, utf8_start, pre, nullptr);
+    trace_bounds(utf8_start, pre, bounds);
+
+    if (cache) {
+        cache->insert(text, n, _generation, bounds);
+    }
+}
+
+void Automaton::batch_states(size_t count, const char* const* texts, const std::vector<uint32_t>* utf8_starts,
+                             std::vector<uint32_t>* states) const {
+    struct Stream {
+        const uint8_t* s;
+        const uint32_t* starts; // utf8_start of the text
+        uint32_t* out; // State after each character
+        size_t i, n; // Byte
+        size_t j; // Char
+        uint32_t u; // Node
+        bool low; // Next nibble is the low half of s[i]
+    };
+
+    const bool normalizing = _normalize.flags() != 0;
+
+    std::vector<Stream> active;
+    for (size_t k = 0; k < count; k++) {
+        states[k].resize(utf8_starts[k].size() - 1);
+        auto n = utf8_starts[k].back();
+        if (n != 0) {
+            auto s = reinterpret_cast<const uint8_t*>(texts[k]);
+            active.push_back(Stream{s, utf8_starts[k].data(), states[k].data(), 0, n, 0, ROOT, false});
+        }
+    }
+
+    while (!active.empty()) {
+        for (size_t a = 0; a < active.size(); ) {
+            auto& st = active[a];
+            auto byte = st.s[st.i];
+
+            uint8_t norm = 0;
+            if (normalizing && !st.low && st.i == st.starts[st.j]) {
+                norm = _normalize(reinterpret_cast<const char*>(st.s + st.i), st.starts[st.j + 1] - st.i);
+            }
+
+            if (norm) {
+                // A normalized character reads its single byte as in next_state, without interleaving
+                st.u = _keyword_bytes[norm] ? t[t[st.u].ch[norm >> OFFSET]].ch[norm & MASK] : ROOT;
+                st.i = st.starts[st.j + 1];
+                st.out[st.j++] = st.u;
+            } else if (!st.low && st.i == st.starts[st.j] && byte < 0x80
+                       && (!_keyword_bytes[byte] || (st.u == ROOT && !_start_bytes[byte]))) {
+                // Same shortcut as next_state, or a byte no keyword starts with read at the root: no memory access
+                st.u = ROOT;
+                st.out[st.j++] = ROOT;
+                st.i++;
+            } else if (!st.low) {
+                st.u = t[st.u].ch[byte >> OFFSET];
+                st.low = true;
+                LLACA_PREFETCH(&t[st.u].ch[byte & MASK]);
+            } else {
+                st.u = t[st.u].ch[byte & MASK];
+                st.low = false;
+                st.i++;
+                if (st.i == st.starts[st.j + 1]) {
+                    st.out[st.j++] = st.u;
+                }
+                if (st.i < st.n) {
+                    LLACA_PREFETCH(&t[st.u].ch[st.s[st.i] >> OFFSET]);
+                }
+            }
+
+            if (st.i == st.n) {
+                active[a] = active.back();
+                active.pop_back();
+            } else {
+                a++;
+            }
+        }
+    }
+}
+
+void Automaton::cut_bounds_batch(size_t count, const char* const* texts, const size_t* lengths,
+                                 std::vector<uint32_t>* bounds, unsigned streams) const {
+    check_built();
+    streams = std::max(1u, std::min(streams, MAX_BATCH_STREAMS));
+
+    std::vector<const char*> group;
+    std::vector<size_t> index;
+    std::vector<std::vector<uint32_t>> utf8_start(streams), states(streams);
+    std::vector<int> pre;
+    auto cache = this->cache();
+
+    for (size_t begin = 0; begin < count; ) {
+        // Next group of texts that are not empty or cached
+        group.clear();
+        index.clear();
+        for (; begin < count && group.size() < streams; begin++) {
+            bounds[begin].clear();
+            if (lengths[begin] == 0) {
+                continue;
+            }
+            char_starts(texts[begin], lengths[begin], utf8_start[group.size()]);
+            if (cache && cache->lookup(texts[begin], lengths[begin], _generation, bounds[begin])) {
                 continue;
             }
-            auto pre_node = get_node(border.pre);
-            auto len_border = border.length;
-            auto log_cnt_pre = pre_node.log_trie_sum;
-            auto log_cnt_border = border.log_end;
-            auto prob = log_cnt_border - log_cnt_pre;
-            if (cut_all && len_border != 1) {
-                collect_word(utf8_start[j - len_border + 1], utf8_start.back() + char_len - utf8_start[j - len_border + 1]);
+            group.push_back(texts[begin]);
+            index.push_back(begin);
+        }
+
+        batch_states(group.size(), group.data(), utf8_start.data(), states.data());
+
+        for (size_t g = 0; g < group.size(); g++) {
+            auto k = index[g];
+            cut_dp(group[g], utf8_start[g], pre, nullptr, states[g].data());
+            trace_bounds(utf8_start[g], pre, bounds[k]);
+            if (cache) {
+                cache->insert(texts[k], lengths[k], _generation, bounds[k]);
             }
-            if (prob > max_prob.back()) {
-                max_prob.back() = prob;
-                pre.back() = j - len_border;
+        }
+    }
+}
+
+void Automaton::append_offsets(size_t count, const char* const* texts, const size_t* lengths, const char* base,
+                               std::vector<int64_t>& word_ptr, std::vector<int64_t>& spans) const {
+    std::vector<std::vector<uint32_t>> bounds(std::min(count, CUT_OFFSETS_CHUNK));
+    for (size_t first = 0; first < count; first += CUT_OFFSETS_CHUNK) {
+        auto chunk = std::min(count - first, CUT_OFFSETS_CHUNK);
+        cut_bounds_batch(chunk, texts + first, lengths + first, bounds.data());
+
+        for (size_t k = 0; k < chunk; k++) {
+            int64_t shift = base ? texts[first + k] - base : 0;
+            const auto& b = bounds[k];
+            for (size_t w = 0; w + 1 < b.size(); w++) {
+                spans.push_back(shift + b[w]);
+                spans.push_back(shift + b[w + 1]);
             }
+            word_ptr.push_back(spans.size() / 2);
         }
+    }
+}
+
+void Automaton::cut_offsets(size_t count, const char* const* texts, const size_t* lengths,
+                            std::vector<int64_t>& word_ptr, std::vector<int64_t>& spans) const {
+    word_ptr.assign(1, 0);
+    spans.clear();
+    append_offsets(count, texts, lengths, nullptr, word_ptr, spans);
+}
+
+void Automaton::cut_offsets(const char* data, size_t n, std::vector<int64_t>& word_ptr,
+                            std::vector<int64_t>& spans) const {
+    std::vector<const char*> lines;
+    std::vector<size_t> lengths;
+    for (size_t p = 0; p < n; ) {
+        auto newline = static_cast<const char*>(memchr(data + p, '\n', n - p));
+        size_t end = newline ? newline - data : n;
+        size_t length = end - p;
+        if (newline && length && data[end - 1] == '\r') {
+            length--;
+        }
+        lines.push_back(data + p);
+        lengths.push_back(length);
+        p = end + 1;
+    }
+
+    word_ptr.assign(1, 0);
+    spans.clear();
+    append_offsets(lines.size(), lines.data(), lengths.data(), data, word_ptr, spans);
+}
+
+std::vector<std::vector<std::string>> Automaton::cut_batch(const std::vector<std::string>& texts,
+                                                           unsigned streams) const {
+    std::vector<const char*> data;
+    std::vector<size_t> lengths;
+    for (const auto& text : texts) {
+        data.push_back(text.data());
+        lengths.push_back(text.size());
+    }
+
+    std::vector<std::vector<uint32_t>> bounds(texts.size());
+    cut_bounds_batch(texts.size(), data.data(), lengths.data(), bounds.data(), streams);
+
+    std::vector<std::vector<std::string>> res;
+    res.reserve(texts.size());
+    for (size_t k = 0; k < texts.size(); k++) {
+        res.push_back(split_words(texts[k], bounds[k]));
+    }
+    return res;
+}
 
-        i += char_len, j++;
+std::vector<std::string> Automaton::cut_join_batch(const std::vector<std::string>& texts, const std::string& delim,
+                                                   unsigned streams) const {
+    std::vector<const char*> data;
+    std::vector<size_t> lengths;
+    for (const auto& text : texts) {
+        data.push_back(text.data());
+        lengths.push_back(text.size());
     }
 
-    _cur_state = pre_state; // Restore previous state
+    std::vector<std::vector<uint32_t>> bounds(texts.size());
+    cut_bounds_batch(texts.size(), data.data(), lengths.data(), bounds.data(), streams);
+
+    std::vector<std::string> res;
+    res.reserve(texts.size());
+    for (size_t k = 0; k < texts.size(); k++) {
+        res.push_back(join_words(texts[k], bounds[k], delim));
+    }
+    return res;
+}
+
+void Automaton::enable_cache(size_t max_bytes, unsigned shards) {
+    std::atomic_store(&_cache, std::make_shared<SegmentationCache>(max_bytes, shards));
+}
+
+void Automaton::disable_cache() {
+    std::atomic_store(&_cache, std::shared_ptr<SegmentationCache>());
+}
+
+void Automaton::clear_cache() {
+    if (auto cache = this->cache()) {
+        cache->clear();
+    }
+}
+
+CacheStats Automaton::cache_stats() const {
+    auto cache = this->cache();
+    return cache ? cache->stats() : CacheStats{0, 0, 0, 0};
+}
+
+uint64_t Automaton::generation() const {
+    return _generation;
+}
+
+std::vector<std::string> Automaton::cut(const std::string& text, bool cut_all) const {
+    std::vector<std::string> words;
+
+    if (text.empty()) {
+        return words;
+    }
 
     if (cut_all) {
+        std::vector<uint32_t> spans;
+        cut_all_spans(text.data(), text.size(), spans);
+        words.reserve(spans.size() / 2);
+        for (size_t k = 0; k < spans.size(); k += 2) {
+            words.push_back(text.substr(spans[k], spans[k + 1] - spans[k]));
+        }
         return words;
     }
 
-    utf8_start.push_back(n);
+    cut(text, [&words, &text](uint32_t begin, uint32_t end) {
+        words.push_back(text.substr(begin, end - begin));
+    });
 
-    // Trace back to get the words
-    j--;
-    while (j >= 0) {
-        collect_word(utf8_start[pre[j] + 1], utf8_start[j + 1] - utf8_start[pre[j] + 1]);
-        j = pre[j];
+    return words;
+}
+
+void Automaton::cut_all_spans(const char* text, size_t n, std::vector<uint32_t>& spans) const {
+    spans.clear();
+    if (n == 0) {
+        return;
     }
 
-    std::reverse(words.begin(), words.end());
+    std::vector<uint32_t> utf8_start;
+    std::vector<int> pre;
+    char_starts(text, n, utf8_start);
+    cut_dp(text, utf8_start, pre, &spans);
+}
+
+WordRange Automaton::words(const char* text, size_t n) const {
+    std::vector<uint32_t> bounds;
+    cut_bounds(text, n, bounds);
+    return WordRange(text, std::move(bounds));
+}
 
-    return words;
+WordRange Automaton::words(const std::string& text) const {
+    return words(text.data(), text.size());
+}
+
+std::string Automaton::cut_join(const std::string& text, const std::string& delim) const {
+    std::string res;
+    res.reserve(text.size() * 2);
+
+    cut(text, [&res, &text, &delim](uint32_t begin, uint32_t end) {
+        if (begin != 0) {
+            res += delim;
+        }
+        res.append(text, begin, end - begin);
+    });
+
+    return res;
+}
+
+void Automaton::cut_file(const std::string& input_path, const std::string& output_path,
+                         const std::string& delim, unsigned threads) const {
+    segment_file(Mode::CUT, input_path, output_path, delim, threads);
+}
+
+void Automaton::cut_bounds_many(size_t count, const char* const* texts, const size_t* lengths,
+                                std::vector<uint32_t>* bounds, unsigned threads) const {
+    segment_many(Mode::CUT, count, texts, lengths, bounds, threads);
+}
+
+double Automaton::cut_viterbi_bounds(const char* text, size_t n, std::vector<uint32_t>& bounds, bool unigram) const {
+    check_built();
+    bounds.clear();
+    if (n == 0) {
+        return 0;
+    }
+
+    std::vector<uint32_t> utf8_start;
+    char_starts(text, n, utf8_start);
+    int m = utf8_start.size() - 1;
+
+    // path[j + 1] is the log-probability of the best path over chars [0, j], pre[j] the char before its last word
+    std::vector<double> path(m + 1, -std::numeric_limits<double>::infinity());
+    std::vector<int> pre(m);
+    path[0] = 0;
+
+    for_each_edge(text, utf8_start, unigram, [&path, &pre](int j, int p, double prob) {
+        if (path[p + 1] + prob > path[j + 1]) {
+            path[j + 1] = path[p + 1] + prob;
+            pre[j] = p;
+        }
+    });
+
+    for (int j = m - 1; j >= 0; j = pre[j]) {
+        bounds.push_back(utf8_start[j + 1]);
+    }
+    bounds.push_back(0);
+    std::reverse(bounds.begin(), bounds.end());
+
+    return path[m];
+}
+
+std::vector<std::string> Automaton::cut_viterbi(const std::string& text, bool unigram, double* log_prob) const {
+    std::vector<uint32_t> bounds;
+    auto prob = cut_viterbi_bounds(text.data(), text.size(), bounds, unigram);
+    if (log_prob) {
+        *log_prob = prob;
+    }
+
+    return split_words(text, bounds);
+}
+
+std::string Automaton::cut_viterbi_join(const std::string& text, const std::string& delim, bool unigram,
+                                        double* log_prob) const {
+    std::vector<uint32_t> bounds;
+    auto prob = cut_viterbi_bounds(text.data(), text.size(), bounds, unigram);
+    if (log_prob) {
+        *log_prob = prob;
+    }
+
+    return join_words(text, bounds, delim);
+}
+
+void Automaton::cut_viterbi_bounds_many(size_t count, const char* const* texts, const size_t* lengths,
+                                        std::vector<uint32_t>* bounds, bool unigram, unsigned threads) const {
+    segment_many(unigram ? Mode::UNIGRAM : Mode::VITERBI, count, texts, lengths, bounds, threads);
+}
+
+void Automaton::cut_viterbi_file(const std::string& input_path, const std::string& output_path,
+                                 const std::string& delim, bool unigram, unsigned threads) const {
+    segment_file(unigram ? Mode::UNIGRAM : Mode::VITERBI, input_path, output_path, delim, threads);
+}
+
+std::vector<double> Automaton::log_prob_batch(const std::vector<std::string>& texts, bool unigram) const {
+    std::vector<double> res;
+    res.reserve(texts.size());
+    std::vector<uint32_t> bounds;
+    for (const auto& text : texts) {
+        res.push_back(cut_viterbi_bounds(text.data(), text.size(), bounds, unigram));
+    }
+    return res;
+}
+
+Lattice Automaton::lattice(const std::string& text, bool unigram) const {
+    return lattice(text.data(), text.size(), unigram);
+}
+
+Lattice Automaton::lattice(const char* text, size_t n, bool unigram) const {
+    check_built();
+
+    Lattice res;
+    res.offsets.push_back(0);
+    if (n == 0) {
+        return res;
+    }
+
+    std::vector<uint32_t> utf8_start;
+    char_starts(text, n, utf8_start);
+
+    for_each_edge(text, utf8_start, unigram, [&res](int j, int p, double prob) {
+        if (res.offsets.size() == static_cast<size_t>(j) + 1) { // First word ending at j
+            res.offsets.push_back(res.offsets.back());
+        }
+        res.start.push_back(p + 1);
+        res.score.push_back(prob);
+        res.offsets.back()++;
+    });
+
+    return res;
+}
+
+std::vector<std::pair<std::vector<uint32_t>, double>> Automaton::cut_nbest_bounds(const char* text, size_t n,
+                                                                                  size_t k, bool unigram) const {
+    check_built();
+
+    std::vector<std::pair<std::vector<uint32_t>, double>> res;
+    if (k == 0) {
+        return res;
+    }
+    if (n == 0) {
+        res.emplace_back(std::vector<uint32_t>(), 0);
+        return res;
+    }
+
+    std::vector<uint32_t> utf8_start;
+    char_starts(text, n, utf8_start);
+    int m = utf8_start.size() - 1;
+
+    // Lattice with parallel words merged (CSR as in Lattice), and the forward Viterbi:
+    // path[j] is the best score of chars [0, j)
+    std::vector<uint32_t> offsets(1, 0), start;
+    std::vector<double> score;
+    std::vector<double> path(m + 1, -std::numeric_limits<double>::infinity());
+    path[0] = 0;
+
+    for_each_edge(text, utf8_start, unigram, [&](int j, int p, double prob) {
+        if (path[p + 1] + prob > path[j + 1]) {
+            path[j + 1] = path[p + 1] + prob;
+        }
+
+        if (offsets.size() == static_cast<size_t>(j) + 1) {
+            offsets.push_back(offsets.back());
+        }
+        for (auto e = offsets[j]; e < offsets[j + 1]; e++) {
+            if (start[e] == static_cast<uint32_t>(p + 1)) {
+                score[e] = std::max(score[e], prob);
+                return;
+            }
+        }
+        start.push_back(p + 1);
+        score.push_back(prob);
+        offsets.back()++;
+    });
+
+    // Best-first search backwards from the end over partial paths covering chars [pos, m).
+    // path[pos] is the exact best score of the rest, so complete paths come out best first.
+    // Each queued partial path guarantees a complete one scoring its priority,
+    // so only as many as there are segmentations still missing are kept.
+    struct Partial {
+        int pos;
+        int edge; // Word from pos to the parent's pos
+        int parent;
+        double suffix; // Score of chars [pos, m)
+    };
+    std::vector<Partial> pool(1, Partial{m, -1, -1, 0});
+    std::set<std::pair<double, int>> queue; // (priority, pool index)
+    queue.emplace(path[m], 0);
+
+    while (!queue.empty() && res.size() < k) {
+        auto top = std::prev(queue.end())->second;
+        queue.erase(std::prev(queue.end()));
+        auto cur = pool[top];
+
+        if (cur.pos == 0) {
+            // Parents run left to right, sum in the same order as the forward Viterbi
+            std::vector<uint32_t> bounds(1, 0);
+            double log_prob = 0;
+            for (auto e = top; pool[e].parent != -1; e = pool[e].parent) {
+                log_prob += score[pool[e].edge];
+                bounds.push_back(utf8_start[pool[pool[e].parent].pos]);
+            }
+            res.emplace_back(std::move(bounds), log_prob);
+            continue;
+        }
+
+        auto j = cur.pos - 1;
+        for (auto e = offsets[j]; e < offsets[j + 1]; e++) {
+            auto suffix = cur.suffix + score[e];
+            pool.push_back(Partial{static_cast<int>(start[e]), static_cast<int>(e), top, suffix});
+            queue.emplace(path[start[e]] + suffix, static_cast<int>(pool.size()) - 1);
+            if (queue.size() > k - res.size()) {
+                queue.erase(queue.begin());
+            }
+        }
+    }
+
+    return res;
+}
+
+std::vector<std::pair<std::vector<std::string>, double>> Automaton::cut_nbest(const std::string& text, size_t k,
+                                                                              bool unigram) const {
+    std::vector<std::pair<std::vector<std::string>, double>> res;
+    for (auto& segmentation : cut_nbest_bounds(text.data(), text.size(), k, unigram)) {
+        res.emplace_back(split_words(text, segmentation.first), segmentation.second);
+    }
+    return res;
+}
+
+void Automaton::max_cut_bounds(const char* text, size_t n, std::vector<uint32_t>& bounds, bool reverse) const {
+    check_built();
+    bounds.clear();
+    if (n == 0) {
+        return;
+    }
+
+    std::vector<uint32_t> utf8_start;
+    char_starts(text, n, utf8_start);
+    int m = utf8_start.size() - 1;
+
+    // FMM: link[j] is the char after the longest keyword starting at char j.
+    // BMM: link[j] is the first char of the longest keyword ending at char j.
+    std::vector<int> link(m);
+    for (int j = 0; j < m; j++) {
+        link[j] = reverse ? j : j + 1;
+    }
+
+    auto state = ROOT;
+    for (int j = 0; j < m; j++) {
+        state = next_state(state, text + utf8_start[j], utf8_start[j + 1] - utf8_start[j]);
+
+        // Keywords ending here, longest first
+        for (auto v = state; v != ROOT; v = t[v].fail) {
+            if (t[v].end == 0) {
+                continue;
+            }
+            int first = j - static_cast<int>(word_length(v)) + 1;
+            if (reverse) {
+                link[j] = std::min(link[j], first);
+                break;
+            }
+            link[first] = std::max(link[first], j + 1);
+        }
+    }
+
+    if (reverse) {
+        for (int j = m - 1; j >= 0; j = link[j] - 1) {
+            bounds.push_back(utf8_start[j + 1]);
+        }
+        bounds.push_back(0);
+        std::reverse(bounds.begin(), bounds.end());
+    } else {
+        for (int j = 0; j < m; j = link[j]) {
+            bounds.push_back(utf8_start[j]);
+        }
+        bounds.push_back(n);
+    }
+}
+
+std::vector<std::string> Automaton::max_cut(const std::string& text, bool reverse) const {
+    std::vector<uint32_t> bounds;
+    max_cut_bounds(text.data(), text.size(), bounds, reverse);
+
+    return split_words(text, bounds);
+}
+
+std::string Automaton::max_cut_join(const std::string& text, const std::string& delim, bool reverse) const {
+    std::vector<uint32_t> bounds;
+    max_cut_bounds(text.data(), text.size(), bounds, reverse);
+
+    return join_words(text, bounds, delim);
+}
+
+std::vector<std::string> Automaton::max_cut_batch(const std::vector<std::string>& texts, const std::string& delim,
+                                                  bool reverse) const {
+    std::vector<std::string> res;
+    res.reserve(texts.size());
+    for (const auto& text : texts) {
+        res.push_back(max_cut_join(text, delim, reverse));
+    }
+    return res;
+}
+
+void Automaton::max_cut_file(const std::string& input_path, const std::string& output_path,
+                             const std::string& delim, bool reverse, unsigned threads) const {
+    segment_file(reverse ? Mode::BMM : Mode::FMM, input_path, output_path, delim, threads);
+}
+
+void Automaton::segment_bounds(Mode mode, const char* text, size_t n, std::vector<uint32_t>& bounds) const {
+    if (mode == Mode::CUT) {
+        cut_bounds(text, n, bounds);
+    } else if (mode == Mode::VITERBI || mode == Mode::UNIGRAM) {
+        cut_viterbi_bounds(text, n, bounds, mode == Mode::UNIGRAM);
+    } else {
+        max_cut_bounds(text, n, bounds, mode == Mode::BMM);
+    }
+}
+
+void Automaton::segment_many(Mode mode, size_t count, const char* const* texts, const size_t* lengths,
+                             std::vector<uint32_t>* bounds, unsigned threads) const {
+    check_built();
+
+    const size_t chunks = (count + SEGMENT_MANY_CHUNK - 1) / SEGMENT_MANY_CHUNK;
+    auto cut_chunk = [this, mode, texts, lengths, bounds, count](size_t k) {
+        auto first = k * SEGMENT_MANY_CHUNK;
+        auto chunk = std::min(count - first, SEGMENT_MANY_CHUNK);
+        if (mode == Mode::CUT) {
+            cut_bounds_batch(chunk, texts + first, lengths + first, bounds + first);
+        } else {
+            for (size_t g = first; g < first + chunk; g++) {
+                segment_bounds(mode, texts[g], lengths[g], bounds[g]);
+            }
+        }
+    };
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<size_t>(threads, std::max<size_t>(chunks, 1));
+
+    if (threads <= 1) {
+        for (size_t k = 0; k < chunks; k++) {
+            cut_chunk(k);
+        }
+        return;
+    }
+
+    // Chunks write disjoint bounds, so workers only share the index of the next chunk
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex mutex;
+
+    auto worker = [&]() {
+        try {
+            for (size_t k; (k = next++) < chunks; ) {
+                cut_chunk(k);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next = chunks;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    for (auto& th : pool) {
+        th.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void Automaton::segment_file(Mode mode, const std::string& input_path, const std::string& output_path,
+                             const std::string& delim, unsigned threads) const {
+    check_built();
+
+    MappedFile input(input_path);
+    const char* data = input.data();
+    const size_t size = input.size();
+
+    std::ofstream fout(output_path, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+    if (!fout.is_open()) {
+        throw std::runtime_error("Failed to open output file: " + output_path);
+    }
+
+    // Split the input into chunks of whole lines
+    std::vector<size_t> chunk_start;
+    for (size_t p = 0; p < size; ) {
+        chunk_start.push_back(p);
+        p = std::min(p + CUT_FILE_CHUNK, size);
+        auto newline = static_cast<const char*>(memchr(data + p, '\n', size - p));
+        p = newline ? newline - data + 1 : size;
+    }
+    chunk_start.push_back(size);
+    const size_t chunks = chunk_start.size() - 1;
+
+    // Same output as joining cut() over the lines read in Python text mode:
+    // "\r\n" and "\r" end a line like "\n" and are written as "\n"
+    auto cut_chunk = [this, mode, data, &chunk_start, &delim](size_t k, std::string& out) {
+        // Lines are segmented BATCH_STREAMS at a time, so cut can interleave their traversals
+        const char* texts[BATCH_STREAMS];
+        size_t lengths[BATCH_STREAMS];
+        std::string lines[BATCH_STREAMS]; // Lines ending in "\r" or "\r\n", rewritten to end in "\n"
+        std::vector<uint32_t> bounds[BATCH_STREAMS];
+        size_t count = 0;
+
+        auto flush = [&]() {
+            if (mode == Mode::CUT) {
+                cut_bounds_batch(count, texts, lengths, bounds);
+            } else {
+                for (size_t g = 0; g < count; g++) {
+                    segment_bounds(mode, texts[g], lengths[g], bounds[g]);
+                }
+            }
+            for (size_t g = 0; g < count; g++) {
+                for (size_t w = 0; w + 1 < bounds[g].size(); w++) {
+                    if (w) {
+                        out += delim;
+                    }
+                    out.append(texts[g] + bounds[g][w], bounds[g][w + 1] - bounds[g][w]);
+                }
+            }
+            count = 0;
+        };
+
+        auto p = data + chunk_start[k], end = data + chunk_start[k + 1];
+        out.reserve((end - p) * 2);
+
+        while (p < end) {
+            auto eol = p;
+            while (eol < end && *eol != '\n' && *eol != '\r') {
+                eol++;
+            }
+
+            const char* text = p;
+            size_t n = eol - p;
+            if (eol == end) {
+                p = end;
+            } else if (*eol == '\n') {
+                n++;
+                p = eol + 1;
+            } else {
+                auto& line = lines[count];
+                line.assign(p, eol - p);
+                line += '\n';
+                text = line.data();
+                n = line.size();
+                p = eol + 1 + (eol + 1 < end && eol[1] == '\n');
+            }
+
+            texts[count] = text;
+            lengths[count] = n;
+            if (++count == BATCH_STREAMS) {
+                flush();
+            }
+        }
+        flush();
+    };
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<size_t>(threads, std::max<size_t>(chunks, 1));
+
+    // A full disk or an I/O error must not pass for a complete output
+    auto write_failed = [&output_path]() {
+        return std::runtime_error("Failed to write output file: " + output_path);
+    };
+    auto close_output = [&]() {
+        fout.close();
+        if (!fout) {
+            throw write_failed();
+        }
+    };
+
+    if (threads <= 1) {
+        for (size_t k = 0; k < chunks; k++) {
+            std::string out;
+            cut_chunk(k, out);
+            if (!fout.write(out.data(), out.size())) {
+                throw write_failed();
+            }
+        }
+        close_output();
+        return;
+    }
+
+    // Workers cut chunks in any order, this thread writes them back in input order.
+    // At most `window` chunks are cut ahead of the writer, which bounds the reorder buffer.
+    const size_t window = 2 * threads;
+    std::vector<std::string> results(chunks);
+    std::vector<char> ready(chunks, 0);
+    size_t next = 0, written = 0;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cv_ready, cv_space;
+
+    auto worker = [&]() {
+        while (true) {
+            size_t k;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_space.wait(lock, [&] { return error || next >= chunks || next < written + window; });
+                if (error || next >= chunks) {
+                    return;
+                }
+                k = next++;
+            }
+
+            std::string out;
+            try {
+                cut_chunk(k, out);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                cv_ready.notify_all();
+                cv_space.notify_all();
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            results[k].swap(out);
+            ready[k] = 1;
+            cv_ready.notify_all();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+
+    for (size_t k = 0; k < chunks; k++) {
+        std::string out;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_ready.wait(lock, [&] { return error || ready[k]; });
+            if (error) {
+                break;
+            }
+            out.swap(results[k]);
+        }
+        bool ok = static_cast<bool>(fout.write(out.data(), out.size()));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            written = k + 1;
+            if (!ok && !error) {
+                error = std::make_exception_ptr(write_failed());
+            }
+        }
+        cv_space.notify_all();
+        if (!ok) {
+            break;
+        }
+    }
+
+    for (auto& th : pool) {
+        th.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    close_output();
+}
+
+
+std::vector<Match> Automaton::find_all(const std::string& text, MatchPolicy policy) const {
+    return find_all(text.data(), text.size(), policy);
+}
+
+std::vector<Match> Automaton::find_all(const char* text, size_t n, MatchPolicy policy) const {
+    std::vector<Match> matches;
+    find_all(text, n, policy, [&matches](uint32_t begin, uint32_t end, uint32_t id) {
+        matches.push_back({begin, end, id});
+    });
+    return matches;
+}
+
+std::vector<std::vector<Match>> Automaton::find_all_batch(const std::vector<std::string>& texts,
+                                                          MatchPolicy policy) const {
+    std::vector<const char*> ptrs;
+    std::vector<size_t> lengths;
+    for (const auto& text : texts) {
+        ptrs.push_back(text.data());
+        lengths.push_back(text.size());
+    }
+
+    std::vector<std::vector<Match>> matches(texts.size());
+    find_all_batch(texts.size(), ptrs.data(), lengths.data(), policy,
+                   [&matches](size_t k, uint32_t begin, uint32_t end, uint32_t id) {
+                       matches[k].push_back({begin, end, id});
+                   });
+    return matches;
+}
+
+// C++ literal of a float that reads back as the same value
+static std::string float_literal(float x) {
+    if (std::isinf(x)) {
+        return x < 0 ? "NO_WORD" : "-NO_WORD";
+    }
+    std::ostringstream oss;
+    oss << std::setprecision(std::numeric_limits<float>::max_digits10) << x;
+    auto res = oss.str();
+    if (res.find_first_of(".e") == std::string::npos) {
+        res += ".0";
+    }
+    return res + "f";
+}
+
+void Automaton::write_source(const std::string& name, const std::string& header_path,
+                             const std::string& source_path) const {
+    check_built();
+    if (_normalize.flags()) {
+        throw std::runtime_error("write_source does not support normalization");
+    }
+
+    bool valid = !name.empty() && !utf8::is_digit(name[0]);
+    for (char c : name) {
+        valid = valid && (utf8::is_digit(c) || utf8::is_alpha(c) || c == '_');
+    }
+    if (!valid) {
+        throw std::invalid_argument("Not a C++ identifier: " + name);
+    }
+
+    std::ofstream header(header_path, std::ofstream::out | std::ofstream::trunc);
+    if (!header.is_open()) {
+        throw std::runtime_error("Failed to open output file: " + header_path);
+    }
+    std::ofstream source(source_path, std::ofstream::out | std::ofstream::trunc);
+    if (!source.is_open()) {
+        throw std::runtime_error("Failed to open output file: " + source_path);
+    }
+
+    auto guard = "TRIE_GRAM_STATIC_" + name + "_H";
+    std::transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+    auto header_name = header_path.substr(header_path.find_last_of("/\\") + 1);
+
+    header << "#ifndef " << guard << "\n"
+           << "#define " << guard << "\n\n"
+           << "// Generated by Automaton::write_source, do not edit.\n"
+           << "// Segmentation with a " << _word_count << " keyword dictionary compiled in, same results as Automaton::cut.\n\n"
+           << "#include <cstdint>\n"
+           << "#include <cstddef>\n"
+           << "#include <string>\n"
+           << "#include <vector>\n\n"
+           << "namespace automaton {\n"
+           << "namespace " << name << " {\n\n"
+           << "// Word boundaries of text[0, n): word k is text[bounds[k], bounds[k + 1])\n"
+           << "void cut_bounds(const char* text, size_t n, std::vector<uint32_t>& bounds);\n\n"
+           << "std::vector<std::string> cut(const std::string& text);\n\n"
+           << "std::string cut_join(const std::string& text, const std::string& delim);\n\n"
+           << "} // namespace " << name << "\n"
+           << "} // namespace automaton\n\n"
+           << "#endif // " << guard << "\n";
+
+    // Narrowest state type, so more of the transition table stays in cache
+    auto state_type = t.size() <= (1u << 8) ? "uint8_t" : t.size() <= (1u << 16) ? "uint16_t" : "uint32_t";
+    auto length_type = _max_length < (1u << 8) ? "uint8_t" : _max_length < (1u << 16) ? "uint16_t" : "uint32_t";
+
+    uint64_t keyword_bytes[4] = {0, 0, 0, 0};
+    for (uint32_t b = 0; b < 256; b++) {
+        if (_keyword_bytes[b]) {
+            keyword_bytes[b >> 6] |= uint64_t(1) << (b & 63);
+        }
+    }
+
+    source << "// Generated by Automaton::write_source, do not edit.\n"
+           << "// Compile with the repository root on the include path.\n\n"
+           << "#include \"" << header_name << "\"\n\n"
+           << "#include \"automaton/src/static_automaton.h\"\n\n"
+           << "namespace automaton {\n"
+           << "namespace " << name << " {\n\n"
+           << "using static_automaton::NO_WORD;\n\n"
+           << "namespace {\n\n"
+           << "struct Tables {\n"
+           << "    typedef " << state_type << " State;\n"
+           << "    static constexpr size_t NODE_COUNT = " << t.size() << ";\n"
+           << "    static constexpr float MIN_PROB = " << float_literal(-t[ROOT].log_trie_sum) << ";\n"
+           << "    static constexpr uint64_t KEYWORD_BYTES[4] = {";
+    for (int k = 0; k < 4; k++) {
+        source << (k ? ", " : "") << keyword_bytes[k] << "ull";
+    }
+    source << "};\n"
+           << "    static constexpr State CH[NODE_COUNT][16] = {\n";
+    for (const auto& node : t) {
+        source << "        {";
+        for (uint32_t i = 0; i < SIZE; i++) {
+            source << (i ? "," : "") << node.ch[i];
+        }
+        source << "},\n";
+    }
+    source << "    };\n"
+           << "    static constexpr float BEST_PROB[NODE_COUNT] = {\n";
+    for (size_t u = 0; u < best.size(); u++) {
+        source << (u % 8 ? " " : "        ") << float_literal(best[u].prob) << (u % 8 == 7 ? ",\n" : ",");
+    }
+    source << (best.size() % 8 ? "\n" : "") << "    };\n"
+           << "    static constexpr " << length_type << " BEST_LENGTH[NODE_COUNT] = {\n";
+    for (size_t u = 0; u < best.size(); u++) {
+        source << (u % 32 ? " " : "        ") << best[u].length << (u % 32 == 31 ? ",\n" : ",");
+    }
+    source << (best.size() % 32 ? "\n" : "") << "    };\n"
+           << "};\n\n"
+           << "constexpr uint64_t Tables::KEYWORD_BYTES[4];\n"
+           << "constexpr Tables::State Tables::CH[Tables::NODE_COUNT][16];\n"
+           << "constexpr float Tables::BEST_PROB[Tables::NODE_COUNT];\n"
+           << "constexpr " << length_type << " Tables::BEST_LENGTH[Tables::NODE_COUNT];\n\n"
+           << "} // namespace\n\n"
+           << "void cut_bounds(const char* text, size_t n, std::vector<uint32_t>& bounds) {\n"
+           << "    static_automaton::cut_bounds<Tables>(text, n, bounds);\n"
+           << "}\n\n"
+           << "std::vector<std::string> cut(const std::string& text) {\n"
+           << "    return static_automaton::cut<Tables>(text);\n"
+           << "}\n\n"
+           << "std::string cut_join(const std::string& text, const std::string& delim) {\n"
+           << "    return static_automaton::cut_join<Tables>(text, delim);\n"
+           << "}\n\n"
+           << "} // namespace " << name << "\n"
+           << "} // namespace automaton\n";
+
+    if (!header || !source) {
+        throw std::runtime_error("Failed to write source files for " + name);
+    }
 }
 
 } // namespace automaton
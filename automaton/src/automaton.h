@@ -9,6 +9,17 @@
 #include <queue>
 #include <cmath>
 #include <algorithm>
+#include <bitset>
+#include <limits>
+#include <utility>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+
+#include "../../common/utf8.h"
+#include "pretokenize.h"
+#include "normalize.h"
+#include "segmentation_cache.h"
 
 namespace automaton {
 
@@ -17,18 +28,23 @@ static const uint8_t SIZE = 1 << OFFSET;
 static const uint8_t MASK = 0xf;
 static const uint8_t INVALID_UTF8 = -1;
 static const uint32_t ROOT = 0;
-static const uint32_t MAX_FREQ = 1 << 24;
-static const uint32_t MAX_UTF8_LEN = 1 << 8;
+static const uint32_t PACKED_FREQ = (1 << 24) - 1; // Node::end saturates here, larger frequencies are in a side table
+static const uint32_t PACKED_LENGTH = (1 << 8) - 1; // Node::length saturates here, longer keywords are in a side table
+static const uint32_t FIND_ALL_RING = 1 << 8; // Character starts find_all keeps on the stack
 static const uint32_t INIT_SIZE = 2048;
+static const unsigned BATCH_STREAMS = 16; // Texts traversed together by the batch cuts
+static const unsigned MAX_BATCH_STREAMS = 64;
 
 
+// Frequency (end) and length of the keyword ending at a node, packed for the common case.
+// Use Automaton::word_freq and Automaton::word_length, which also read the side tables.
 struct Node {
     uint32_t length : 8;
     uint32_t end : 24;
     uint32_t ch[SIZE];
     uint32_t id, parent, pre, fail;
     float log_end, log_trie_sum;
-    uint64_t trie_sum;
+    uint64_t trie_sum; // Saturates at the uint64_t maximum
 
     Node(uint32_t id = ROOT, uint32_t parent = ROOT) 
     : length(0), end(0),
@@ -39,15 +55,165 @@ struct Node {
     }
 };
 
+// Best border of a state: the highest scoring keyword ending there
+struct Candidate {
+    float prob; // log_end - log_trie_sum(pre), -inf if no keyword ends at the state
+    uint32_t length; // UTF-8 characters, 0 if no keyword ends at the state
+};
+
+// Which occurrences find_all reports
+enum class MatchPolicy {
+    OVERLAPPING, // Every occurrence, by end position, longest first among those ending together
+    NON_OVERLAPPING, // The first occurrence to end (the longest if several do), then the search restarts after it
+    LEFTMOST_LONGEST, // The longest keyword starting leftmost, then the search restarts after it
+};
+
+// Occurrence of a keyword in a text
+struct Match {
+    uint32_t begin, end; // Byte span in the text
+    uint32_t id; // Node id of the keyword's end state, see get_node
+};
+
+// Candidate words of a text in CSR form (characters, not bytes).
+// The words ending at character j are k in [offsets[j], offsets[j + 1]), word k covers [start[k], j + 1).
+struct Lattice {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> start;
+    std::vector<double> score; // Log-probability of the word
+};
+
+// Words of a text made on demand from its boundary array (see Automaton::cut_bounds).
+// Views the text, which must outlive the range.
+class WordRange {
+private:
+    const char* _text;
+    std::vector<uint32_t> _bounds;
+
+public:
+    // Input iterator over the words, front to back
+    class iterator {
+    private:
+        const WordRange* _range;
+        size_t _k; // Word index
+
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef std::string value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const std::string* pointer;
+        typedef std::string reference;
+
+        iterator() : _range(nullptr), _k(0) {}
+        iterator(const WordRange* range, size_t k) : _range(range), _k(k) {}
+
+        std::string operator*() const {
+            return std::string(_range->_text + begin(), end() - begin());
+        }
+        iterator& operator++() {
+            _k++;
+            return *this;
+        }
+        iterator operator++(int) {
+            auto it = *this;
+            _k++;
+            return it;
+        }
+        bool operator==(const iterator& other) const { return _k == other._k; }
+        bool operator!=(const iterator& other) const { return _k != other._k; }
+
+        // Byte span of the current word in the text
+        uint32_t begin() const { return _range->_bounds[_k]; }
+        uint32_t end() const { return _range->_bounds[_k + 1]; }
+    };
+
+    WordRange() : _text("") {}
+    WordRange(const char* text, std::vector<uint32_t> bounds) : _text(text), _bounds(std::move(bounds)) {}
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, size()); }
+    size_t size() const { return _bounds.empty() ? 0 : _bounds.size() - 1; }
+};
+
+// Predicted size of an automaton built from dictionary files, see Automaton::estimate.
+// The sizes are in bytes, one per layout the automaton can take.
+struct MemoryEstimate {
+    uint64_t words; // Distinct keywords, after normalization
+    uint64_t nodes; // node_count() once built
+    uint64_t built_bytes; // memory_usage() once built
+    uint64_t peak_bytes; // Most memory held by the automaton while building (the node vector grows by doubling)
+    uint64_t image_bytes; // serialize(), also what from_bytes holds on top of the automaton while loading
+    uint64_t static_bytes; // Tables compiled in by write_source
+};
+
+class StreamSegmenter;
+
+// The const members (cut and friends, find_all, ...) do not touch shared state and may run on several threads at once.
+// insert, load_dict, build and the cursor (trans_string, trans_byte, reset) must not overlap them.
 class Automaton {
+    friend class StreamSegmenter;
+
 private:
     uint32_t _word_count; // Number of keywords
     uint32_t _node_count; // Node count
     uint32_t _cur_state; // Current state
+    uint32_t _max_length; // Maximum keyword length (UTF-8 characters)
+    std::bitset<256> _keyword_bytes; // Bytes appearing in any keyword, or normalizing to one
+    std::bitset<128> _start_bytes; // ASCII bytes leaving the root, the first byte of a keyword (after normalization)
+    normalize::Table _normalize; // Normalization of keywords and of the texts read by the segmenters
+    std::unordered_map<uint32_t, uint64_t> _large_freq; // Frequency of the nodes whose end is PACKED_FREQ
+    std::unordered_map<uint32_t, uint32_t> _long_length; // Length of the nodes whose length is PACKED_LENGTH
+    uint64_t _generation; // Changes on every build, unique across automata
+    std::shared_ptr<SegmentationCache> _cache; // Optional cache of cut_bounds results, read with cache()
     
     std::vector<Node> t; // Trie nodes
+    std::vector<Candidate> best; // Best border of each state, so cut needs one lookup per character
     void get_trie_sum(); // Calculate word frequencies in sub-Tries for each node
     void get_fail(); // Calculate the fail pointer for each node
+    void get_best(); // Calculate the best border for each node
+    void get_start_bytes(); // Calculate _start_bytes from the built automaton
+    void check_built() const; // Throws if nodes were inserted after the last build
+
+    // The current cache, kept alive while in use even if another thread replaces or drops it
+    std::shared_ptr<SegmentationCache> cache() const { return std::atomic_load(&_cache); }
+
+    // State after reading the UTF-8 character s[0, char_len) from `state`
+    uint32_t next_state(uint32_t state, const char* s, uint8_t char_len) const;
+
+    // Pre-tokenization classes of the UTF-8 character s[0, char_len), after normalization
+    uint8_t classify(const char* s, uint8_t char_len) const;
+
+    // Byte offset of each character of text[0, n), followed by n. Throws if the text is not valid UTF-8.
+    void char_starts(const char* text, size_t n, std::vector<uint32_t>& utf8_start) const;
+
+    // Calls visit(j, pre, prob) for every candidate word (pre, j] in the order of get_DAG in TrieGram.py:
+    // the single character, the number and English word spans, then the keywords ending at j, longest first.
+    // All words ending at j are visited before any ending after j.
+    template <class Visit>
+    void for_each_edge(const char* text, const std::vector<uint32_t>& utf8_start, bool unigram, Visit&& visit) const;
+
+    enum class Mode { CUT, FMM, BMM, VITERBI, UNIGRAM }; // UNIGRAM: Viterbi with unigram scores
+    void segment_bounds(Mode mode, const char* text, size_t n, std::vector<uint32_t>& bounds) const;
+    void segment_many(Mode mode, size_t count, const char* const* texts, const size_t* lengths,
+                      std::vector<uint32_t>* bounds, unsigned threads) const;
+    void segment_file(Mode mode, const std::string& input_path, const std::string& output_path,
+                      const std::string& delim, unsigned threads) const;
+
+    // Segmentation DP over the characters of text, utf8_start holds the byte offset of each character (plus the length).
+    // pre[j] is the character before the best word ending at character j.
+    // If spans is given, the byte span [begin, end) of every candidate word is appended to it (full mode).
+    // If states is given, it holds the automaton state after each character (see batch_states).
+    void cut_dp(const char* text, const std::vector<uint32_t>& utf8_start, std::vector<int>& pre,
+                std::vector<uint32_t>* spans, const uint32_t* states = nullptr) const;
+
+    // Automaton state after each character of `count` texts, with their traversals interleaved:
+    // the texts advance in lockstep one nibble at a time, and each prefetches the child it reads next,
+    // so the cache misses of different texts overlap instead of queueing up behind each other.
+    void batch_states(size_t count, const char* const* texts, const std::vector<uint32_t>* utf8_starts,
+                      std::vector<uint32_t>* states) const;
+
+    // Appends the words of the texts to the CSR arrays of cut_offsets, spans relative to base (or each text if null)
+    void append_offsets(size_t count, const char* const* texts, const size_t* lengths, const char* base,
+                        std::vector<int64_t>& word_ptr, std::vector<int64_t>& spans) const;
 
 public:
     // Constructor
@@ -66,19 +232,36 @@ public:
     size_t memory_usage() const;
 
     // Insert a valid UTF-8 keyword into the trie with frequency (if not specified, defaults to 1)
-    void insert(const std::string& s, uint32_t freq = 1);
+    void insert(const std::string& s, uint64_t freq = 1);
 
     // Returns the number of words in the automaton
     uint32_t word_count() const;
 
+    // Returns the maximum keyword length in UTF-8 characters
+    uint32_t max_length() const;
+
     // Get node by id
     Node get_node(uint32_t node_id) const;
 
+    // Returns the number of nodes, node ids are [0, node_count())
+    uint32_t node_count() const;
+
+    // Frequency of the keyword ending at a node, 0 if none (Node::end unless it saturated)
+    uint64_t word_freq(uint32_t node_id) const;
+
+    // Length in UTF-8 characters of the keyword ending at a node (Node::length unless it saturated)
+    uint32_t word_length(uint32_t node_id) const;
+
+    // Copy a column of every node into each non-null array (node_count() entries, 16 per node for ch).
+    // end and length are word_freq and word_length.
+    void node_table(uint64_t* end, uint32_t* length, uint32_t* parent, uint32_t* pre, uint32_t* fail,
+                    float* log_end, float* log_trie_sum, uint64_t* trie_sum, uint32_t* ch) const;
+
     // Get the current state of the automaton
     uint32_t get_state() const;
 
     // Returns border nodes
-    std::vector<Node> get_borders(uint32_t node_id);
+    std::vector<Node> get_borders(uint32_t node_id) const;
 
     // Transition function, accepted a UTF-8 string
     Node trans_string(const std::string& s);
@@ -86,6 +269,12 @@ public:
     // Transition function, accepts a single byte
     Node trans_byte(uint8_t byte);
 
+    // out[i] is the state after reading bytes[i] from states[i], without moving the current state
+    void trans(size_t n, const uint32_t* states, const uint8_t* bytes, uint32_t* out) const;
+
+    // out[i] is the state after reading text[0, i] from `state`, without moving the current state
+    void trans_text(const char* text, size_t n, uint32_t state, uint32_t* out) const;
+
     // Reset the automaton to a new state (defaults to root)
     void reset(uint32_t new_state = ROOT);
 
@@ -98,13 +287,327 @@ public:
     // Build the automaton from multiple dictionary files
     void build(const std::vector<std::string>& dict_paths);
 
+    // build(dict_paths) within max_bytes of memory_usage(): if the dictionaries do not fit, the lowest-frequency
+    // keywords are left out until they do (the longest first among equal frequencies). The nodes are allocated once,
+    // so the automaton never holds more than max_bytes, the distinct keywords are held while building.
+    // Returns the keywords left out (normalized) with their frequencies, lowest first.
+    // The automaton must be empty. Throws std::runtime_error if not even the empty automaton fits.
+    std::vector<std::pair<std::string, uint64_t>> build(const std::vector<std::string>& dict_paths, size_t max_bytes);
+
+    // Size of the automaton that build(dict_paths) would make with the normalization flags (see set_normalization),
+    // from reading the dictionaries without building it. The node count is exact.
+    static MemoryEstimate estimate(const std::vector<std::string>& dict_paths, uint8_t normalization = 0);
+
     // Load a dictionary file into the automaton
     void load_dict(const std::string& dict_path);
 
+    // Normalize keywords and texts with normalize::FULL_WIDTH and/or normalize::CASE_FOLD.
+    // Applies to the segmenters (cut and its variants, cut_viterbi, max_cut, StreamSegmenter), whose boundaries
+    // are still offsets into the original text, not to find_all and the trans* functions, which read raw bytes.
+    // Must be set before the first keyword is inserted.
+    void set_normalization(uint8_t flags);
+
+    // Normalization flags, see set_normalization
+    uint8_t normalization() const;
+
+    // Binary image of the automaton (nodes, best borders and counters) for deserialize.
+    // Nodes are stored as laid out in memory, so only the same build of the library reads it back.
+    std::string serialize() const;
+
+    // Replace the automaton by a serialized one at the start of data[0, n) (bytes after it are ignored).
+    // Throws std::invalid_argument if there is none, or if its links or counters are inconsistent.
+    void deserialize(const char* data, size_t n);
+
     // Cut a text into words
-    std::vector<std::string> cut(const std::string& text, bool cut_all = false);
+    std::vector<std::string> cut(const std::string& text, bool cut_all = false) const;
+
+    // Every candidate word of the full mode (cut with cut_all), overlapping, by end position:
+    // word k is text[spans[2 * k], spans[2 * k + 1])
+    void cut_all_spans(const char* text, size_t n, std::vector<uint32_t>& spans) const;
+
+    // Cut a text into words, calling sink(begin, end) with the byte span of each word in order.
+    // The words are read off the DP back links, no boundary array is made (but for the cache, which stores them).
+    template <class Sink>
+    void cut(const std::string& text, Sink&& sink) const;
+
+    // cut_bounds of texts[k] (lengths[k] bytes) into bounds[k] for every k < count.
+    // Groups of `streams` texts are traversed together (see batch_states), 1 cuts them one by one.
+    void cut_bounds_batch(size_t count, const char* const* texts, const size_t* lengths,
+                          std::vector<uint32_t>* bounds, unsigned streams = BATCH_STREAMS) const;
+
+    // Cut every text into words, in interleaved groups of `streams` texts
+    std::vector<std::vector<std::string>> cut_batch(const std::vector<std::string>& texts,
+                                                    unsigned streams = BATCH_STREAMS) const;
+
+    // cut_join of every text, in interleaved groups of `streams` texts
+    std::vector<std::string> cut_join_batch(const std::vector<std::string>& texts, const std::string& delim,
+                                            unsigned streams = BATCH_STREAMS) const;
+
+    // Words of `count` texts in CSR form: the words of text k are w in [word_ptr[k], word_ptr[k + 1]),
+    // word w is the bytes [spans[2 * w], spans[2 * w + 1]) of its text
+    void cut_offsets(size_t count, const char* const* texts, const size_t* lengths,
+                     std::vector<int64_t>& word_ptr, std::vector<int64_t>& spans) const;
+
+    // cut_offsets over the lines of data[0, n), with spans as offsets into data.
+    // A line ends at "\n" (or "\r\n"), which is not part of it. There is no empty line after a final "\n".
+    void cut_offsets(const char* data, size_t n, std::vector<int64_t>& word_ptr, std::vector<int64_t>& spans) const;
+
+    // Cut text[0, n) into words, made one at a time while iterating. The range views the text.
+    WordRange words(const char* text, size_t n) const;
+    WordRange words(const std::string& text) const;
+    WordRange words(std::string&& text) const = delete; // The range would outlive the text
+
+    // Cut text[0, n) into word boundaries: word k is text[bounds[k], bounds[k + 1])
+    void cut_bounds(const char* text, size_t n, std::vector<uint32_t>& bounds) const;
+
+    // Cache cut results (cut, cut_join, cut_file, not the full mode) in at most max_bytes, split into shards.
+    // Replaces any previous cache, cuts running on other threads finish with the cache they started with.
+    void enable_cache(size_t max_bytes, unsigned shards = 16);
+
+    // Drop the cache, cut computes every text again
+    void disable_cache();
+
+    // Remove all entries and reset the counters
+    void clear_cache();
+
+    // Hits, misses, entries and bytes of the cache (all 0 if it is disabled)
+    CacheStats cache_stats() const;
+
+    // Generation of the built automaton, a new one for every build
+    uint64_t generation() const;
+
+    // Cut a text into words joined by a delimiter
+    std::string cut_join(const std::string& text, const std::string& delim) const;
+
+    // Cut every line of a file and write the lines joined by delim, using `threads` workers (0: one per core).
+    // The output is identical to cut_join over the lines read in Python text mode (universal newlines).
+    void cut_file(const std::string& input_path, const std::string& output_path,
+                  const std::string& delim = " ", unsigned threads = 0) const;
+
+    // cut_bounds of texts[k] (lengths[k] bytes) into bounds[k] for every k < count, using `threads` workers
+    // (0: one per core). Each worker cuts its texts in interleaved groups as cut_bounds_batch.
+    void cut_bounds_many(size_t count, const char* const* texts, const size_t* lengths,
+                         std::vector<uint32_t>* bounds, unsigned threads = 0) const;
+
+    // Full-path Viterbi over the candidate words of get_DAG in TrieGram.py, the scoring of the Python cut.
+    // unigram scores a keyword by log_end - log_trie_sum(root) instead of log_end - log_trie_sum(pre).
+    // Returns the log-probability of the best path (0 for an empty text), bounds as in cut_bounds.
+    double cut_viterbi_bounds(const char* text, size_t n, std::vector<uint32_t>& bounds,
+                              bool unigram = false) const;
+
+    // Words of the best path, its log-probability is stored into log_prob if given
+    std::vector<std::string> cut_viterbi(const std::string& text, bool unigram = false,
+                                         double* log_prob = nullptr) const;
+
+    // Words of the best path joined by a delimiter
+    std::string cut_viterbi_join(const std::string& text, const std::string& delim, bool unigram = false,
+                                 double* log_prob = nullptr) const;
+
+    // cut_viterbi_bounds of every text as in cut_bounds_many, using `threads` workers (0: one per core)
+    void cut_viterbi_bounds_many(size_t count, const char* const* texts, const size_t* lengths,
+                                 std::vector<uint32_t>* bounds, bool unigram = false, unsigned threads = 0) const;
+
+    // cut_file with the full-path Viterbi: the same output as cutf in TrieGram.py
+    void cut_viterbi_file(const std::string& input_path, const std::string& output_path,
+                          const std::string& delim = " ", bool unigram = false, unsigned threads = 0) const;
+
+    // Log-probability of the best path of every text
+    std::vector<double> log_prob_batch(const std::vector<std::string>& texts, bool unigram = false) const;
+
+    // Every candidate word of the Viterbi in get_DAG order, parallel words included
+    Lattice lattice(const std::string& text, bool unigram = false) const;
+
+    // Lattice of text[0, n)
+    Lattice lattice(const char* text, size_t n, bool unigram = false) const;
+
+    // The k highest-scoring segmentations (best first) with their log-probabilities, bounds as in cut_bounds.
+    // Of parallel candidates for the same word only the best one counts, so no segmentation appears twice.
+    std::vector<std::pair<std::vector<uint32_t>, double>> cut_nbest_bounds(const char* text, size_t n, size_t k,
+                                                                           bool unigram = false) const;
+
+    // The k highest-scoring segmentations as words
+    std::vector<std::pair<std::vector<std::string>, double>> cut_nbest(const std::string& text, size_t k,
+                                                                       bool unigram = false) const;
+
+    // Maximum matching: at each step take the longest keyword starting (forward, FMM)
+    // or ending (reverse, BMM) at the current position, a single character if there is none
+    std::vector<std::string> max_cut(const std::string& text, bool reverse = false) const;
+
+    // Maximum matching word boundaries of text[0, n), in the same form as cut_bounds
+    void max_cut_bounds(const char* text, size_t n, std::vector<uint32_t>& bounds, bool reverse = false) const;
+
+    // Maximum matching words joined by a delimiter
+    std::string max_cut_join(const std::string& text, const std::string& delim, bool reverse = false) const;
+
+    // max_cut_join over every text
+    std::vector<std::string> max_cut_batch(const std::vector<std::string>& texts, const std::string& delim,
+                                           bool reverse = false) const;
+
+    // cut_file with maximum matching
+    void max_cut_file(const std::string& input_path, const std::string& output_path,
+                      const std::string& delim = " ", bool reverse = false, unsigned threads = 0) const;
+
+    // Every occurrence of a keyword in text[0, n) allowed by the policy, in text order, as callback(begin, end, id).
+    // Walks the bytes without decoding or allocating, so the text need not be valid UTF-8.
+    template <class Callback>
+    void find_all(const char* text, size_t n, MatchPolicy policy, Callback&& callback) const;
+
+    // find_all over texts[k] (lengths[k] bytes) for every k < count, as callback(k, begin, end, id)
+    template <class Callback>
+    void find_all_batch(size_t count, const char* const* texts, const size_t* lengths, MatchPolicy policy,
+                        Callback&& callback) const;
+
+    // Occurrences of the keywords in a text
+    std::vector<Match> find_all(const std::string& text, MatchPolicy policy = MatchPolicy::OVERLAPPING) const;
+
+    // Occurrences of the keywords in text[0, n)
+    std::vector<Match> find_all(const char* text, size_t n, MatchPolicy policy = MatchPolicy::OVERLAPPING) const;
+
+    // Occurrences of the keywords in every text
+    std::vector<std::vector<Match>> find_all_batch(const std::vector<std::string>& texts,
+                                                   MatchPolicy policy = MatchPolicy::OVERLAPPING) const;
+
+    // Write a C++ header and source defining automaton::<name>::cut_bounds, cut and cut_join
+    // with the tables of this automaton compiled in as constexpr arrays (see static_automaton.h).
+    // They segment like cut, without loading a dictionary at startup.
+    void write_source(const std::string& name, const std::string& header_path, const std::string& source_path) const;
 };
 
+inline uint64_t Automaton::word_freq(uint32_t node_id) const {
+    auto end = t[node_id].end;
+    return end != PACKED_FREQ ? end : _large_freq.at(node_id);
+}
+
+inline uint32_t Automaton::word_length(uint32_t node_id) const {
+    auto length = t[node_id].length;
+    return length != PACKED_LENGTH ? length : _long_length.at(node_id);
+}
+
+template <class Sink>
+void Automaton::cut(const std::string& text, Sink&& sink) const {
+    // Scratch reused by the calls on this thread, moved out while in use so a sink may cut again
+    static thread_local std::vector<uint32_t> scratch_start;
+    static thread_local std::vector<int> scratch_pre;
+
+    check_built();
+    if (text.empty()) {
+        return;
+    }
+
+    auto utf8_start = std::move(scratch_start);
+    if (cache()) { // The cache holds boundary arrays
+        cut_bounds(text.data(), text.size(), utf8_start);
+        for (size_t k = 0; k + 1 < utf8_start.size(); k++) {
+            sink(utf8_start[k], utf8_start[k + 1]);
+        }
+        scratch_start = std::move(utf8_start);
+        return;
+    }
+
+    auto pre = std::move(scratch_pre);
+    char_starts(text.data(), text.size(), utf8_start);
+    cut_dp(text.data(), utf8_start, pre, nullptr);
+
+    // Reverse the back links of the best path in place, so the words come out front to back
+    int m = static_cast<int>(pre.size());
+    int first = m;
+    for (int j = m - 1; j != -1; ) {
+        auto prev = pre[j];
+        pre[j] = first;
+        first = j;
+        j = prev;
+    }
+    uint32_t begin = 0;
+    for (int j = first; j != m; j = pre[j]) {
+        sink(begin, utf8_start[j + 1]);
+        begin = utf8_start[j + 1];
+    }
+
+    scratch_start = std::move(utf8_start);
+    scratch_pre = std::move(pre);
+}
+
+template <class Callback>
+void Automaton::find_all(const char* text, size_t n, MatchPolicy policy, Callback&& callback) const {
+    check_built();
+
+    if (policy == MatchPolicy::LEFTMOST_LONGEST) {
+        // Walk the trie edges (not the fail transitions) from each start, keeping the last keyword passed
+        for (size_t i = 0; i < n; ) {
+            auto u = ROOT, last = ROOT;
+            size_t last_end = i;
+            for (size_t k = i; k < n; k++) {
+                uint8_t byte = static_cast<uint8_t>(text[k]);
+                auto v = t[u].ch[byte >> OFFSET];
+                if (v == ROOT || t[v].parent != u) {
+                    break;
+                }
+                u = t[v].ch[byte & MASK];
+                if (u == ROOT || t[u].parent != v) {
+                    break;
+                }
+                if (t[u].end != 0) {
+                    last = u;
+                    last_end = k + 1;
+                }
+            }
+            if (last != ROOT) {
+                callback(static_cast<uint32_t>(i), static_cast<uint32_t>(last_end), last);
+                i = last_end;
+            } else {
+                i++;
+            }
+        }
+        return;
+    }
+
+    // Keyword lengths are in characters, so remember where the last `ring` characters started,
+    // a power of two of at least max_length(). Any byte but a continuation byte starts a character.
+    uint32_t ring = FIND_ALL_RING;
+    while (ring < _max_length) {
+        ring <<= 1;
+    }
+    uint32_t local_starts[FIND_ALL_RING];
+    std::vector<uint32_t> heap_starts(ring > FIND_ALL_RING ? ring : 0);
+    uint32_t* starts = ring > FIND_ALL_RING ? heap_starts.data() : local_starts;
+    uint32_t chars = 0;
+
+    auto state = ROOT;
+    for (size_t k = 0; k < n; k++) {
+        uint8_t byte = static_cast<uint8_t>(text[k]);
+        if ((byte & 0xc0) != 0x80) {
+            starts[chars++ & (ring - 1)] = k;
+        }
+        if (!_keyword_bytes[byte]) {
+            state = ROOT;
+            continue;
+        }
+        state = t[t[state].ch[byte >> OFFSET]].ch[byte & MASK];
+
+        // Output chain: the state itself, then its fail links, which build() points at end states only
+        for (auto v = state; v != ROOT; v = t[v].fail) {
+            if (t[v].end == 0) {
+                continue;
+            }
+            callback(starts[(chars - word_length(v)) & (ring - 1)], static_cast<uint32_t>(k + 1), v);
+            if (policy == MatchPolicy::NON_OVERLAPPING) {
+                state = ROOT;
+                break;
+            }
+        }
+    }
+}
+
+template <class Callback>
+void Automaton::find_all_batch(size_t count, const char* const* texts, const size_t* lengths, MatchPolicy policy,
+                               Callback&& callback) const {
+    for (size_t k = 0; k < count; k++) {
+        find_all(texts[k], lengths[k], policy, [&callback, k](uint32_t begin, uint32_t end, uint32_t id) {
+            callback(k, begin, end, id);
+        });
+    }
+}
+
 }
 
 #endif // TRIE_GRAM_AUTOMATON_H
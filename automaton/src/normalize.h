@@ -0,0 +1,77 @@
+#ifndef TRIE_GRAM_NORMALIZE_H
+#define TRIE_GRAM_NORMALIZE_H
+
+// Character normalization applied while the automaton reads a text, so no normalized copy is made.
+// A character normalizes to at most one ASCII byte and is still one character,
+// so word boundaries fall on the characters of the original text.
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "../../common/utf8.h"
+
+namespace normalize {
+
+static const uint8_t FULL_WIDTH = 1; // Full-width ASCII (U+FF01-U+FF5E) and the ideographic space (U+3000) as ASCII
+static const uint8_t CASE_FOLD = 2; // A-Z as a-z, full-width ones included with FULL_WIDTH
+
+// The ASCII byte each normalized character maps to, 0 if it is left as is.
+// Index 0-127 is an ASCII byte, 128-255 the code point U+FF00-U+FF7F (low 7 bits).
+class Table {
+private:
+    uint8_t _flags;
+    uint8_t _map[256];
+
+public:
+    explicit Table(uint8_t flags = 0) : _flags(flags) {
+        for (int k = 0; k < 128; k++) {
+            _map[k] = flags & CASE_FOLD && k >= 'A' && k <= 'Z' ? k + 0x20 : 0;
+
+            uint8_t ascii = flags & FULL_WIDTH && k >= 0x01 && k <= 0x5e ? k + 0x20 : 0; // U+FF01-U+FF5E
+            if (flags & CASE_FOLD && ascii >= 'A' && ascii <= 'Z') {
+                ascii += 0x20;
+            }
+            _map[0x80 | k] = ascii;
+        }
+    }
+
+    uint8_t flags() const { return _flags; }
+
+    // The byte the UTF-8 character s[0, len) normalizes to, 0 if it is left as is
+    uint8_t operator()(const char* s, uint8_t len) const {
+        auto b0 = static_cast<uint8_t>(s[0]);
+        if (len == 1) {
+            return b0 < 0x80 ? _map[b0] : 0;
+        }
+        if (len != 3 || !(_flags & FULL_WIDTH)) {
+            return 0;
+        }
+        auto b1 = static_cast<uint8_t>(s[1]), b2 = static_cast<uint8_t>(s[2]);
+        if (b0 == 0xef && (b1 == 0xbc || b1 == 0xbd)) {
+            return _map[0x80 | (b1 - 0xbc) << 6 | (b2 & 0x3f)];
+        }
+        return b0 == 0xe3 && b1 == 0x80 && b2 == 0x80 ? ' ' : 0;
+    }
+
+    // Normalized copy of the valid UTF-8 string s, for keywords
+    std::string apply(const std::string& s) const {
+        std::string res;
+        res.reserve(s.size());
+        for (size_t i = 0; i < s.size(); ) {
+            uint8_t len = utf8::char_len(static_cast<uint8_t>(s[i]));
+            auto c = (*this)(s.data() + i, len);
+            if (c) {
+                res += static_cast<char>(c);
+            } else {
+                res.append(s, i, len);
+            }
+            i += len;
+        }
+        return res;
+    }
+};
+
+} // namespace normalize
+
+#endif // TRIE_GRAM_NORMALIZE_H
@@ -0,0 +1,58 @@
+#ifndef TRIE_GRAM_PRETOKENIZE_H
+#define TRIE_GRAM_PRETOKENIZE_H
+
+// Pre-tokenization rules of get_DAG in TrieGram.py, shared by Automaton::cut and StreamSegmenter:
+//   numbers        [-+]?\d+([.．:：\-－/]\d+)*   edge scores min_prob / 4
+//   English words  [a-zA-Z]+(['-][a-zA-Z]+)*    edge scores min_prob / 2
+//   symbols        \p{P}|\p{S}                  default edge scores min_prob / 2 instead of min_prob
+
+#include "char_class.h"
+#include "../../common/utf8.h"
+
+namespace pretokenize {
+
+// Classes of the UTF-8 character s[0, len), see char_class.h
+inline uint8_t classify(const char* s, uint8_t len) {
+    auto cp = utf8::decode(reinterpret_cast<const uint8_t*>(s), len);
+    return cp < 0x110000 ? char_class::lookup(cp) : 0;
+}
+
+// DFA for HEAD+ (SEP HEAD+)*, optionally preceded by one PREFIX character.
+// Finds the same leftmost, non-overlapping spans as regex finditer. A separator only continues the span
+// when a HEAD character follows it, so each step looks two characters ahead.
+template <uint8_t HEAD, uint8_t SEP, uint8_t PREFIX>
+class SpanRule {
+private:
+    int64_t _start; // First char of the open span, -1 outside a span
+
+public:
+    SpanRule() : _start(-1) {}
+
+    int64_t start() const { return _start; }
+    void reset() { _start = -1; }
+
+    // Feed char j with the classes of chars j, j + 1 and j + 2 (0 past the end).
+    // Returns the first char of the span ending at j, -1 if no span ends here.
+    int64_t step(int64_t j, uint8_t cls, uint8_t next, uint8_t next2) {
+        if (_start == -1) {
+            if (!(cls & HEAD) && !((cls & PREFIX) && (next & HEAD))) {
+                return -1;
+            }
+            _start = j;
+        }
+
+        if ((cls & HEAD) && !(next & HEAD) && !((next & SEP) && (next2 & HEAD))) {
+            auto start = _start;
+            _start = -1;
+            return start;
+        }
+        return -1;
+    }
+};
+
+typedef SpanRule<char_class::DIGIT, char_class::NUM_SEP, char_class::SIGN> NumberRule;
+typedef SpanRule<char_class::ALPHA, char_class::ALPHA_SEP, 0> AlphaRule;
+
+} // namespace pretokenize
+
+#endif // TRIE_GRAM_PRETOKENIZE_H
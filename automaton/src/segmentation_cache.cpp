@@ -0,0 +1,108 @@
+#include "segmentation_cache.h"
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+namespace automaton {
+
+// Rough per-entry cost of the list node, the index slot and the Entry itself
+static const size_t ENTRY_OVERHEAD = 128;
+
+SegmentationCache::SegmentationCache(size_t max_bytes, unsigned shards) {
+    if (shards == 0) {
+        throw std::invalid_argument("Segmentation cache needs at least one shard");
+    }
+    _shard_bytes = max_bytes / shards;
+    std::random_device rd;
+    _seed = (uint64_t(rd()) << 32) ^ rd();
+    for (unsigned i = 0; i < shards; i++) {
+        _shards.emplace_back(new Shard());
+    }
+}
+
+uint64_t SegmentationCache::key(uint64_t hash, uint64_t length, uint64_t generation) const {
+    return hash_bytes(reinterpret_cast<const char*>(&generation), sizeof(generation), hash ^ length ^ _seed);
+}
+
+size_t SegmentationCache::entry_bytes(const Entry& entry) {
+    return ENTRY_OVERHEAD + entry.text.size() + entry.bounds.size() * sizeof(uint32_t);
+}
+
+SegmentationCache::Shard& SegmentationCache::shard(uint64_t key) {
+    return *_shards[(key >> 32) % _shards.size()];
+}
+
+bool SegmentationCache::lookup(const char* text, size_t n, uint64_t generation, std::vector<uint32_t>& bounds) {
+    auto hash = hash_bytes(text, n, _seed);
+    auto k = key(hash, n, generation);
+    auto& s = shard(k);
+
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.index.find(k);
+    if (it == s.index.end() || it->second->hash != hash || it->second->length != n
+        || it->second->generation != generation || memcmp(it->second->text.data(), text, n) != 0) {
+        s.misses++;
+        return false;
+    }
+
+    s.lru.splice(s.lru.begin(), s.lru, it->second); // Most recently used
+    bounds = it->second->bounds;
+    s.hits++;
+    return true;
+}
+
+void SegmentationCache::insert(const char* text, size_t n, uint64_t generation, const std::vector<uint32_t>& bounds) {
+    if (ENTRY_OVERHEAD + n + bounds.size() * sizeof(uint32_t) > _shard_bytes) {
+        return;
+    }
+    Entry entry{hash_bytes(text, n, _seed), n, generation, std::string(text, n), bounds};
+    auto bytes = entry_bytes(entry);
+
+    auto k = key(entry.hash, n, generation);
+    auto& s = shard(k);
+
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.index.find(k);
+    if (it != s.index.end()) { // Cached by another thread meanwhile, or a key collision
+        s.bytes -= entry_bytes(*it->second);
+        s.lru.erase(it->second);
+        s.index.erase(it);
+    }
+
+    while (!s.lru.empty() && s.bytes + bytes > _shard_bytes) {
+        const auto& last = s.lru.back();
+        s.bytes -= entry_bytes(last);
+        s.index.erase(key(last.hash, last.length, last.generation));
+        s.lru.pop_back();
+    }
+
+    s.lru.push_front(std::move(entry));
+    s.index[k] = s.lru.begin();
+    s.bytes += bytes;
+}
+
+void SegmentationCache::clear() {
+    for (auto& s : _shards) {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        s->lru.clear();
+        s->index.clear();
+        s->bytes = 0;
+        s->hits = 0;
+        s->misses = 0;
+    }
+}
+
+CacheStats SegmentationCache::stats() {
+    CacheStats res{0, 0, 0, 0};
+    for (auto& s : _shards) {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        res.hits += s->hits;
+        res.misses += s->misses;
+        res.entries += s->lru.size();
+        res.bytes += s->bytes;
+    }
+    return res;
+}
+
+} // namespace automaton
@@ -0,0 +1,96 @@
+#ifndef TRIE_GRAM_SEGMENTATION_CACHE_H
+#define TRIE_GRAM_SEGMENTATION_CACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+
+namespace automaton {
+
+// 64-bit hash of s[0, n), 8 bytes per step
+inline uint64_t hash_bytes(const char* s, size_t n, uint64_t seed = 0) {
+    const uint64_t k = 0x9E3779B97F4A7C15ull;
+    auto fmix = [](uint64_t h) { // MurmurHash3 finalizer
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    };
+
+    uint64_t h = seed ^ (n * k);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x;
+        memcpy(&x, s + i, 8);
+        h = (h ^ fmix(x)) * k;
+    }
+    if (i < n) {
+        uint64_t x = 0;
+        memcpy(&x, s + i, n - i);
+        h = (h ^ fmix(x)) * k;
+    }
+    return fmix(h);
+}
+
+struct CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t entries;
+    uint64_t bytes; // Estimated memory held by the entries
+};
+
+// LRU cache of word boundaries (as in Automaton::cut_bounds) keyed by the text and the automaton generation.
+// Entries are found by a 64-bit hash of the text, seeded per cache so that collisions cannot be chosen in advance,
+// and the stored text is compared on every hit.
+// The shards have separate locks and LRU lists, each one gets an equal part of the byte budget.
+class SegmentationCache {
+private:
+    struct Entry {
+        uint64_t hash;
+        uint64_t length; // Bytes of the text
+        uint64_t generation;
+        std::string text;
+        std::vector<uint32_t> bounds;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru; // Most recently used first
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index; // By entry key
+        size_t bytes = 0;
+        uint64_t hits = 0, misses = 0;
+    };
+
+    size_t _shard_bytes; // Byte budget of each shard
+    uint64_t _seed; // Of the text hashes
+    std::vector<std::unique_ptr<Shard>> _shards;
+
+    uint64_t key(uint64_t hash, uint64_t length, uint64_t generation) const;
+    static size_t entry_bytes(const Entry& entry);
+    Shard& shard(uint64_t key);
+
+public:
+    SegmentationCache(size_t max_bytes, unsigned shards);
+
+    // Copies the cached boundaries of the text into bounds, returns false on a miss
+    bool lookup(const char* text, size_t n, uint64_t generation, std::vector<uint32_t>& bounds);
+
+    // Caches the boundaries of the text, evicting the least recently used entries of its shard.
+    // Entries larger than a shard's budget are not cached.
+    void insert(const char* text, size_t n, uint64_t generation, const std::vector<uint32_t>& bounds);
+
+    void clear();
+    CacheStats stats();
+};
+
+} // namespace automaton
+
+#endif // TRIE_GRAM_SEGMENTATION_CACHE_H
@@ -0,0 +1,130 @@
+#ifndef TRIE_GRAM_STATIC_AUTOMATON_H
+#define TRIE_GRAM_STATIC_AUTOMATON_H
+
+// Automaton::cut against tables compiled into the program, see Automaton::write_source.
+// Tables is a struct of constexpr members emitted by the generator:
+//   State                 narrowest unsigned type holding every state id
+//   NODE_COUNT            number of states
+//   MIN_PROB              -log_trie_sum of the root, the score of a default edge
+//   KEYWORD_BYTES[4]      bitmask of the bytes appearing in any keyword
+//   CH[NODE_COUNT][16]    nibble transitions, fail links already folded in
+//   BEST_PROB[NODE_COUNT], BEST_LENGTH[NODE_COUNT]   best border of each state (Candidate)
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+
+#include "pretokenize.h"
+#include "../../common/utf8.h"
+
+namespace automaton {
+namespace static_automaton {
+
+// BEST_PROB of a state no keyword ends at
+constexpr float NO_WORD = -std::numeric_limits<float>::infinity();
+
+template <class Tables>
+inline typename Tables::State next_state(typename Tables::State state, const char* s, uint8_t char_len) {
+    auto first = static_cast<uint8_t>(s[0]);
+    if (char_len == 1 && !(Tables::KEYWORD_BYTES[first >> 6] >> (first & 63) & 1)) {
+        return 0;
+    }
+    for (uint8_t k = 0; k < char_len; k++) {
+        auto byte = static_cast<uint8_t>(s[k]);
+        state = Tables::CH[state][byte >> 4];
+        state = Tables::CH[state][byte & 0xf];
+    }
+    return state;
+}
+
+// Same segmentation as Automaton::cut_bounds of the automaton the tables were generated from
+template <class Tables>
+void cut_bounds(const char* text, size_t n, std::vector<uint32_t>& bounds) {
+    bounds.clear();
+    if (n == 0) {
+        return;
+    }
+
+    std::vector<uint32_t> utf8_start;
+    if (!utf8::char_starts(text, n, utf8_start)) {
+        throw std::invalid_argument("Invalid UTF-8 string at byte " + std::to_string(utf8::invalid_offset(text, n)));
+    }
+    utf8_start.push_back(n);
+    int m = utf8_start.size() - 1;
+
+    std::vector<uint8_t> cls(m + 2, 0);
+    for (int j = 0; j < m; j++) {
+        cls[j] = pretokenize::classify(text + utf8_start[j], utf8_start[j + 1] - utf8_start[j]);
+    }
+
+    // Best edge ending at each character, as in Automaton::cut_dp
+    std::vector<int> pre(m);
+    typename Tables::State state = 0;
+    pretokenize::NumberRule number;
+    pretokenize::AlphaRule alpha;
+
+    for (int j = 0; j < m; j++) {
+        state = next_state<Tables>(state, text + utf8_start[j], utf8_start[j + 1] - utf8_start[j]);
+
+        float max_prob = cls[j] & char_class::SYMBOL ? Tables::MIN_PROB / 2 : Tables::MIN_PROB;
+        pre[j] = j - 1;
+
+        auto span = number.step(j, cls[j], cls[j + 1], cls[j + 2]);
+        if (span != -1 && Tables::MIN_PROB / 4 > max_prob) {
+            max_prob = Tables::MIN_PROB / 4;
+            pre[j] = span - 1;
+        }
+        span = alpha.step(j, cls[j], cls[j + 1], cls[j + 2]);
+        if (span != -1 && Tables::MIN_PROB / 2 > max_prob) {
+            max_prob = Tables::MIN_PROB / 2;
+            pre[j] = span - 1;
+        }
+
+        if (Tables::BEST_PROB[state] > max_prob) {
+            pre[j] = j - Tables::BEST_LENGTH[state];
+        }
+    }
+
+    for (int j = m - 1; j >= 0; j = pre[j]) {
+        bounds.push_back(utf8_start[j + 1]);
+    }
+    bounds.push_back(0);
+    std::reverse(bounds.begin(), bounds.end());
+}
+
+template <class Tables>
+std::vector<std::string> cut(const std::string& text) {
+    std::vector<uint32_t> bounds;
+    cut_bounds<Tables>(text.data(), text.size(), bounds);
+
+    std::vector<std::string> words;
+    for (size_t k = 0; k + 1 < bounds.size(); k++) {
+        words.push_back(text.substr(bounds[k], bounds[k + 1] - bounds[k]));
+    }
+    return words;
+}
+
+template <class Tables>
+std::string cut_join(const std::string& text, const std::string& delim) {
+    std::vector<uint32_t> bounds;
+    cut_bounds<Tables>(text.data(), text.size(), bounds);
+
+    std::string res;
+    res.reserve(text.size() * 2);
+    for (size_t k = 0; k + 1 < bounds.size(); k++) {
+        if (k) {
+            res += delim;
+        }
+        res.append(text, bounds[k], bounds[k + 1] - bounds[k]);
+    }
+    return res;
+}
+
+} // namespace static_automaton
+} // namespace automaton
+
+#endif // TRIE_GRAM_STATIC_AUTOMATON_H
@@ -0,0 +1,249 @@
+#include "stream_segmenter.h"
+
+namespace automaton {
+
+// Check for final words every FLUSH_INTERVAL characters inside a chunk
+static const uint32_t FLUSH_INTERVAL = 64;
+
+StreamSegmenter::StreamSegmenter(const Automaton& automaton)
+: _automaton(automaton),
+  _min_prob(-automaton.t[ROOT].log_trie_sum),
+  _window(std::max<uint32_t>(automaton.max_length(), 1)) {
+    automaton.check_built();
+    reset();
+}
+
+void StreamSegmenter::reset() {
+    _state = ROOT;
+    _char_count = 0;
+    _byte_count = 0;
+    _scored = 0;
+    _done = 0;
+    _number.reset();
+    _alpha.reset();
+    _pending.clear();
+    _buffer.clear();
+    _buffer_base = 0;
+    _cells.clear();
+    _cells_base = 0;
+    _flush_lo = -2; // Matches no range
+    _flush_last = -2;
+    _common = -1;
+}
+
+StreamSegmenter::Cell& StreamSegmenter::cell(int64_t j) {
+    return _cells[j - _cells_base];
+}
+
+uint64_t StreamSegmenter::char_end(int64_t j) {
+    return j + 1 < _char_count ? cell(j + 1).utf8_start : _byte_count;
+}
+
+uint8_t StreamSegmenter::cls(int64_t j) {
+    return j < _char_count ? cell(j).cls : 0;
+}
+
+void StreamSegmenter::check_char(const char* s, uint8_t char_len) const {
+    // Same check as Automaton::cut, the offset is the character's in the stream
+    if (char_len == 0 || utf8::invalid_offset(s, char_len) != char_len) {
+        throw std::invalid_argument("Invalid UTF-8 string at byte " + std::to_string(_byte_count));
+    }
+}
+
+void StreamSegmenter::push_char(const char* s, uint8_t char_len) {
+    const auto& t = _automaton.t;
+    auto u = _state;
+
+    // A normalized character is read as its single byte, see Automaton::set_normalization
+    char norm = _automaton._normalize(s, char_len);
+    auto bytes = norm ? &norm : s;
+    uint8_t len = norm ? 1 : char_len;
+    for (uint8_t k = 0; k < len; k++) {
+        uint8_t byte = static_cast<uint8_t>(bytes[k]);
+        u = t[u].ch[byte >> OFFSET];
+        u = t[u].ch[byte & MASK];
+    }
+    _state = u;
+
+    _buffer.append(s, char_len);
+    _cells.push_back({_byte_count, _char_count - 1, _min_prob, u, _automaton.classify(s, char_len)});
+
+    _char_count++;
+    _byte_count += char_len;
+
+    // The rules look two characters ahead
+    if (_char_count - _scored > 2) {
+        score();
+    }
+}
+
+// Same scoring as Automaton::cut
+void StreamSegmenter::score() {
+    auto j = _scored;
+    auto& cur = cell(j);
+    auto next = cls(j + 1), next2 = cls(j + 2);
+
+    if (cur.cls & char_class::SYMBOL) {
+        cur.max_prob = _min_prob / 2;
+    }
+
+    // Number and English word spans ending here
+    auto span = _number.step(j, cur.cls, next, next2);
+    if (span != -1 && _min_prob / 4 > cur.max_prob) {
+        cur.max_prob = _min_prob / 4;
+        cur.pre = span - 1;
+    }
+    span = _alpha.step(j, cur.cls, next, next2);
+    if (span != -1 && _min_prob / 2 > cur.max_prob) {
+        cur.max_prob = _min_prob / 2;
+        cur.pre = span - 1;
+    }
+
+    // Best keyword ending here
+    const auto& candidate = _automaton.best[cur.state];
+    if (candidate.prob > cur.max_prob) {
+        cur.max_prob = candidate.prob;
+        cur.pre = j - candidate.length;
+    }
+
+    _scored++;
+}
+
+void StreamSegmenter::emit(int64_t last, std::vector<std::string>& words) {
+    std::vector<int64_t> ends;
+    for (auto j = last; j != _done - 1; j = cell(j).pre) {
+        ends.push_back(j);
+    }
+    std::reverse(ends.begin(), ends.end());
+
+    auto begin = cell(_done).utf8_start;
+    for (auto j : ends) {
+        auto end = char_end(j);
+        words.push_back(_buffer.substr(begin - _buffer_base, end - begin));
+        begin = end;
+    }
+
+    _done = last + 1;
+    _buffer.erase(0, begin - _buffer_base);
+    _buffer_base = begin;
+}
+
+void StreamSegmenter::flush_final(std::vector<std::string>& words) {
+    if (_scored == _done) {
+        return;
+    }
+
+    // Any later character links back into [lo, last], directly or through an open span
+    auto last = _scored - 1;
+    auto lo = last + 1 - static_cast<int64_t>(_window);
+    if (_number.start() != -1) {
+        lo = std::min(lo, _number.start() - 1);
+    }
+    if (_alpha.start() != -1) {
+        lo = std::min(lo, _alpha.start() - 1);
+    }
+    lo = std::max(lo, _done - 1);
+
+    // Words before the common ancestor of all back links from [lo, last] are final.
+    // While an open span holds lo in place, the range only grows, so carry on from the last flush
+    // and visit each character once instead of walking the whole span again.
+    auto from = lo + 1;
+    if (lo == _flush_lo) {
+        from = _flush_last + 1;
+    } else {
+        _common = lo;
+    }
+    _flush_lo = lo;
+    _flush_last = last;
+
+    // _common is an ancestor of every character in [lo, j), so only links leaving the range need a walk
+    for (auto j = from; j <= last && _common != _done - 1; j++) {
+        auto k = cell(j).pre;
+        if (k >= lo) {
+            continue;
+        }
+        while (k != _common) {
+            if (k > _common) {
+                k = cell(k).pre;
+            } else {
+                _common = cell(_common).pre;
+            }
+        }
+    }
+
+    auto common = _common;
+    if (common == _done - 1) {
+        return;
+    }
+
+    emit(common, words);
+
+    while (_cells_base < common) {
+        _cells.pop_front();
+        _cells_base++;
+    }
+}
+
+std::vector<std::string> StreamSegmenter::feed(const std::string& chunk) {
+    return feed(chunk.data(), chunk.size());
+}
+
+std::vector<std::string> StreamSegmenter::feed(const char* chunk, size_t n) {
+    std::vector<std::string> words;
+    size_t i = 0;
+
+    // Complete the character split by the previous chunk
+    if (!_pending.empty()) {
+        uint8_t char_len = utf8::char_len(static_cast<uint8_t>(_pending[0]));
+        auto take = std::min(char_len - _pending.size(), n);
+        _pending.append(chunk, take);
+        i = take;
+        if (_pending.size() < char_len) {
+            return words;
+        }
+        check_char(_pending.data(), char_len);
+        push_char(_pending.data(), char_len);
+        _pending.clear();
+    }
+
+    while (i < n) {
+        uint8_t char_len = utf8::char_len(static_cast<uint8_t>(chunk[i]));
+        if (char_len != 0 && i + char_len > n) { // Checked once the next chunk completes it
+            _pending.assign(chunk + i, n - i);
+            break;
+        }
+
+        check_char(chunk + i, char_len);
+        push_char(chunk + i, char_len);
+        i += char_len;
+
+        if (_char_count % FLUSH_INTERVAL == 0) {
+            flush_final(words);
+        }
+    }
+
+    flush_final(words);
+
+    return words;
+}
+
+std::vector<std::string> StreamSegmenter::finish() {
+    if (!_pending.empty()) {
+        throw std::invalid_argument("Invalid UTF-8 string: incomplete character at end of stream");
+    }
+
+    while (_scored < _char_count) {
+        score();
+    }
+
+    std::vector<std::string> words;
+    if (_char_count != _done) {
+        emit(_char_count - 1, words);
+    }
+
+    reset();
+
+    return words;
+}
+
+} // namespace automaton
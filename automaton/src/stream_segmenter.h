@@ -0,0 +1,73 @@
+#ifndef TRIE_GRAM_STREAM_SEGMENTER_H
+#define TRIE_GRAM_STREAM_SEGMENTER_H
+
+#include "automaton.h"
+
+#include <deque>
+
+namespace automaton {
+
+// Incremental version of Automaton::cut over a byte stream.
+// Chunks may split UTF-8 characters. A word is emitted as soon as no later input can change it,
+// and only the DP state of the last few characters (about max_length() of the automaton) is kept.
+// A character is scored once the two after it have arrived, the lookahead of the number/English word rules,
+// and an open number or English word span holds back its own words until the span ends.
+// The automaton must not be modified while a segmenter is using it.
+class StreamSegmenter {
+private:
+    struct Cell {
+        uint64_t utf8_start; // Byte offset of the character in the stream
+        int64_t pre; // End of the previous word (char), -1 for the start of the stream
+        float max_prob;
+        uint32_t state; // Automaton state after the character
+        uint8_t cls; // Pre-tokenization classes
+    };
+
+    const Automaton& _automaton;
+    float _min_prob;
+    uint32_t _window; // Farthest a dictionary word can reach back (chars)
+
+    uint32_t _state; // Automaton state after the last character
+    int64_t _char_count; // Characters consumed
+    uint64_t _byte_count; // Bytes consumed (complete characters only)
+    int64_t _scored; // Characters with their DP state computed
+    int64_t _done; // Characters already emitted
+    pretokenize::NumberRule _number;
+    pretokenize::AlphaRule _alpha;
+
+    std::string _pending; // Incomplete UTF-8 character at the end of the last chunk
+    std::string _buffer; // Bytes of the characters not emitted yet
+    uint64_t _buffer_base; // Byte offset of _buffer[0] in the stream
+    std::deque<Cell> _cells; // DP state of the window
+    int64_t _cells_base; // Char index of _cells[0]
+    int64_t _flush_lo, _flush_last; // Range [lo, last] of the last flush_final
+    int64_t _common; // Common ancestor of the back links from that range
+
+    Cell& cell(int64_t j);
+    uint64_t char_end(int64_t j); // Byte offset after the j-th character
+    uint8_t cls(int64_t j); // Classes of char j, 0 past the consumed characters
+    void check_char(const char* s, uint8_t char_len) const; // Throws unless s[0, char_len) is a valid character
+    void push_char(const char* s, uint8_t char_len);
+    void score(); // Compute the DP state of the next unscored character
+    void emit(int64_t last, std::vector<std::string>& words); // Emit the words up to char `last`
+    void flush_final(std::vector<std::string>& words);
+
+public:
+    explicit StreamSegmenter(const Automaton& automaton);
+
+    // Consume a chunk of bytes, returns the words that became final
+    std::vector<std::string> feed(const std::string& chunk);
+
+    // Consume the bytes chunk[0, n)
+    std::vector<std::string> feed(const char* chunk, size_t n);
+
+    // End of stream, returns the remaining words and resets the segmenter
+    std::vector<std::string> finish();
+
+    // Drop all buffered input and start a new stream
+    void reset();
+};
+
+} // namespace automaton
+
+#endif // TRIE_GRAM_STREAM_SEGMENTER_H
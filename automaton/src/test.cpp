@@ -1,4 +1,7 @@
-// g++ test.cpp automaton.cpp -std=c++17
+// g++ test.cpp automaton.cpp segmentation_cache.cpp stream_segmenter.cpp -std=c++17 -pthread
+
+#include <atomic>
+#include <thread>
 
 #include "automaton.h"
 
@@ -26,6 +29,65 @@ int main() {
     std::cout << std::endl;
 
     std::cout << "Memory usage: " << automaton.memory_usage() << " bytes" << std::endl;
+
+    // Toggle the cache while other threads cut with it
+    std::vector<std::string> lines;
+    std::ifstream fin("../../data/test/pku_test.utf8");
+    for (std::string line; std::getline(fin, line); ) {
+        lines.push_back(line);
+    }
+    std::vector<const char*> texts;
+    std::vector<size_t> lengths;
+    for (const auto& line : lines) {
+        texts.push_back(line.data());
+        lengths.push_back(line.size());
+    }
+    std::vector<std::vector<uint32_t>> expected(lines.size()), bounds(lines.size());
+    automaton.cut_bounds_many(lines.size(), texts.data(), lengths.data(), expected.data());
+
+    std::atomic<bool> done(false);
+    std::thread toggler([&] {
+        for (unsigned k = 0; !done; k++) {
+            if (k % 2) {
+                automaton.disable_cache();
+            } else {
+                automaton.enable_cache(1 << 20, 4);
+            }
+        }
+    });
+    bool same = true;
+    for (int round = 0; round < 10; round++) {
+        automaton.cut_bounds_many(lines.size(), texts.data(), lengths.data(), bounds.data(), 4);
+        same = same && bounds == expected;
+    }
+    done = true;
+    toggler.join();
+
+    std::cout << "Cut while toggling the cache: " << (same ? "same" : "DIFFERENT") << std::endl;
+
+    // A budget below the nodes reserved by the constructor
+    automaton::Automaton small;
+    auto dropped = small.build(std::vector<std::string>{"../../data/dict/pku_dict.utf8"}, 20000);
+    std::cout << "Built in 20000 bytes: " << small.memory_usage() << " bytes, " << small.word_count() << " words, "
+              << dropped.size() << " left out" << (small.memory_usage() <= 20000 ? "" : " (OVER BUDGET)") << std::endl;
+
+    // Images with a flipped byte are rejected, or load into an automaton that still cuts
+    std::string image = small.serialize();
+    size_t rejected = 0, accepted = 0;
+    for (size_t k = 0; k < image.size(); k += 7) {
+        std::string corrupted = image;
+        corrupted[k] ^= 0x5A;
+        automaton::Automaton loaded;
+        try {
+            loaded.deserialize(corrupted.data(), corrupted.size());
+        } catch (const std::invalid_argument&) {
+            rejected++;
+            continue;
+        }
+        loaded.cut(text);
+        accepted++;
+    }
+    std::cout << "Corrupted images: " << rejected << " rejected, " << accepted << " loaded" << std::endl;
     
     return 0;
 }
\ No newline at end of file
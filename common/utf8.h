@@ -0,0 +1,307 @@
+#ifndef LLACA_UTF8_H
+#define LLACA_UTF8_H
+
+// UTF-8 and ASCII run helpers shared by the automaton and the suffix array.
+// Bulk scanning uses AVX2 or SSE4.2 when the CPU supports them (checked once at runtime),
+// and falls back to a scalar loop otherwise.
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LLACA_UTF8_X86 1
+#endif
+
+namespace utf8 {
+
+static const size_t INVALID = -1;
+
+// Character length indexed by the top 5 bits of the first byte, 0 for continuation and invalid bytes
+static const uint8_t LEN_TABLE[32] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xxxxxxx
+    0, 0, 0, 0, 0, 0, 0, 0, // 10xxxxxx
+    2, 2, 2, 2, // 110xxxxx
+    3, 3, // 1110xxxx
+    4, // 11110xxx
+    0 // 11111xxx
+};
+
+// Length of a UTF-8 character from its first byte, 0 if the byte cannot start a character
+inline uint8_t char_len(uint8_t byte) {
+    return LEN_TABLE[byte >> 3];
+}
+
+// Code point of the well-formed character s[0, len)
+inline uint32_t decode(const uint8_t* s, uint8_t len) {
+    switch (len) {
+        case 1:
+            return s[0];
+        case 2:
+            return (s[0] & 0x1F) << 6 | (s[1] & 0x3F);
+        case 3:
+            return (s[0] & 0x0F) << 12 | (s[1] & 0x3F) << 6 | (s[2] & 0x3F);
+        default:
+            return (s[0] & 0x07) << 18 | (s[1] & 0x3F) << 12 | (s[2] & 0x3F) << 6 | (s[3] & 0x3F);
+    }
+}
+
+// Scalar scan of s[i, n), `pending` continuation bytes are still owed by a character started before i
+template <typename T>
+inline bool char_starts_scalar(const uint8_t* s, size_t i, size_t n, uint32_t pending, std::vector<T>& starts) {
+    for (; pending && i < n; pending--, i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return false;
+        }
+    }
+    if (pending) {
+        return false;
+    }
+
+    while (i < n) {
+        uint8_t len = char_len(s[i]);
+        if (len == 0 || i + len > n) {
+            return false;
+        }
+        for (uint8_t k = 1; k < len; k++) {
+            if ((s[i + k] & 0xC0) != 0x80) {
+                return false;
+            }
+        }
+        starts.push_back(static_cast<T>(i));
+        i += len;
+    }
+    return true;
+}
+
+// Byte classes for ASCII runs
+inline bool is_digit(uint8_t byte) {
+    return static_cast<uint8_t>(byte - '0') < 10;
+}
+
+inline bool is_alpha(uint8_t byte) {
+    return static_cast<uint8_t>((byte | 0x20) - 'a') < 26;
+}
+
+// Length of the run of ASCII digits (ALPHA = false) or letters (ALPHA = true) starting at s[i]
+template <bool ALPHA>
+inline size_t ascii_run_scalar(const uint8_t* s, size_t i, size_t n) {
+    size_t start = i;
+    while (i < n && (ALPHA ? is_alpha(s[i]) : is_digit(s[i]))) {
+        i++;
+    }
+    return i - start;
+}
+
+#ifdef LLACA_UTF8_X86
+
+// Checks one block given the byte class masks, `carry` holds the continuation bytes owed to the next block
+inline bool check_block(uint32_t cont, uint32_t lead2, uint32_t lead3, uint32_t lead4, uint32_t bad,
+                        unsigned width, uint64_t& carry) {
+    uint64_t multi = lead2 | lead3 | lead4;
+    uint64_t expected = carry | (multi << 1) | (uint64_t(lead3 | lead4) << 2) | (uint64_t(lead4) << 3);
+    uint64_t full = (uint64_t(1) << width) - 1;
+    carry = expected >> width;
+    return !bad && (expected & full) == cont;
+}
+
+template <typename T>
+inline void push_starts(uint32_t mask, size_t base, std::vector<T>& starts) {
+    while (mask) {
+        starts.push_back(static_cast<T>(base + __builtin_ctz(mask)));
+        mask &= mask - 1;
+    }
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+inline bool char_starts_avx2(const uint8_t* s, size_t n, std::vector<T>& starts) {
+    const __m256i c0 = _mm256_set1_epi8(char(0xC0)), c80 = _mm256_set1_epi8(char(0x80));
+    const __m256i e0 = _mm256_set1_epi8(char(0xE0)), f0 = _mm256_set1_epi8(char(0xF0));
+    const __m256i f8 = _mm256_set1_epi8(char(0xF8));
+    uint64_t carry = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        if (!carry && !_mm256_movemask_epi8(b)) { // All ASCII
+            for (size_t k = 0; k < 32; k++) {
+                starts.push_back(static_cast<T>(i + k));
+            }
+            continue;
+        }
+        uint32_t cont = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(b, c0), c80));
+        uint32_t lead2 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(b, e0), c0));
+        uint32_t lead3 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(b, f0), e0));
+        uint32_t lead4 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(b, f8), f0));
+        uint32_t bad = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(b, f8), f8));
+        if (!check_block(cont, lead2, lead3, lead4, bad, 32, carry)) {
+            return false;
+        }
+        push_starts(~cont, i, starts);
+    }
+
+    return char_starts_scalar(s, i, n, __builtin_popcountll(carry), starts);
+}
+
+template <typename T>
+__attribute__((target("sse4.2")))
+inline bool char_starts_sse42(const uint8_t* s, size_t n, std::vector<T>& starts) {
+    const __m128i c0 = _mm_set1_epi8(char(0xC0)), c80 = _mm_set1_epi8(char(0x80));
+    const __m128i e0 = _mm_set1_epi8(char(0xE0)), f0 = _mm_set1_epi8(char(0xF0));
+    const __m128i f8 = _mm_set1_epi8(char(0xF8));
+    uint64_t carry = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        if (!carry && !_mm_movemask_epi8(b)) { // All ASCII
+            for (size_t k = 0; k < 16; k++) {
+                starts.push_back(static_cast<T>(i + k));
+            }
+            continue;
+        }
+        uint32_t cont = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(b, c0), c80));
+        uint32_t lead2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(b, e0), c0));
+        uint32_t lead3 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(b, f0), e0));
+        uint32_t lead4 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(b, f8), f0));
+        uint32_t bad = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(b, f8), f8));
+        if (!check_block(cont, lead2, lead3, lead4, bad, 16, carry)) {
+            return false;
+        }
+        push_starts(~cont & 0xFFFF, i, starts);
+    }
+
+    return char_starts_scalar(s, i, n, __builtin_popcountll(carry), starts);
+}
+
+template <bool ALPHA>
+__attribute__((target("avx2")))
+inline size_t ascii_run_avx2(const uint8_t* s, size_t n) {
+    // Shift the class to [0, limit] and compare unsigned
+    const __m256i fold = _mm256_set1_epi8(ALPHA ? 0x20 : 0);
+    const __m256i low = _mm256_set1_epi8(ALPHA ? 'a' : '0');
+    const __m256i limit = _mm256_set1_epi8(ALPHA ? 25 : 9);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        __m256i x = _mm256_sub_epi8(_mm256_or_si256(b, fold), low);
+        uint32_t in = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(x, limit), limit));
+        if (in != 0xFFFFFFFF) {
+            return i + __builtin_ctz(~in);
+        }
+    }
+
+    return i + ascii_run_scalar<ALPHA>(s, i, n);
+}
+
+template <bool ALPHA>
+__attribute__((target("sse4.2")))
+inline size_t ascii_run_sse42(const uint8_t* s, size_t n) {
+    const __m128i fold = _mm_set1_epi8(ALPHA ? 0x20 : 0);
+    const __m128i low = _mm_set1_epi8(ALPHA ? 'a' : '0');
+    const __m128i limit = _mm_set1_epi8(ALPHA ? 25 : 9);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i x = _mm_sub_epi8(_mm_or_si128(b, fold), low);
+        uint32_t in = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, limit), limit));
+        if (in != 0xFFFF) {
+            return i + __builtin_ctz(~in);
+        }
+    }
+
+    return i + ascii_run_scalar<ALPHA>(s, i, n);
+}
+
+enum Level { SCALAR, SSE42, AVX2 };
+
+inline Level simd_level() {
+    static const Level level = __builtin_cpu_supports("avx2") ? AVX2
+                             : __builtin_cpu_supports("sse4.2") ? SSE42
+                             : SCALAR;
+    return level;
+}
+
+#endif // LLACA_UTF8_X86
+
+// Validate s[0, n) and append the byte offset of every character to `starts`.
+// Only the byte structure is checked (lead bytes, continuation bytes, truncation), not overlong forms.
+// Returns false if s is not valid UTF-8, `starts` is then left partially filled.
+template <typename T>
+inline bool char_starts(const char* s, size_t n, std::vector<T>& starts) {
+    auto bytes = reinterpret_cast<const uint8_t*>(s);
+    starts.reserve(starts.size() + n);
+#ifdef LLACA_UTF8_X86
+    switch (simd_level()) {
+        case AVX2:
+            return char_starts_avx2(bytes, n, starts);
+        case SSE42:
+            return char_starts_sse42(bytes, n, starts);
+        default:
+            break;
+    }
+#endif
+    return char_starts_scalar(bytes, 0, n, 0, starts);
+}
+
+// Length of the run of ASCII digits (ALPHA = false) or letters (ALPHA = true) at the start of s[0, n)
+template <bool ALPHA>
+inline size_t ascii_run(const char* s, size_t n) {
+    auto bytes = reinterpret_cast<const uint8_t*>(s);
+#ifdef LLACA_UTF8_X86
+    switch (simd_level()) {
+        case AVX2:
+            return ascii_run_avx2<ALPHA>(bytes, n);
+        case SSE42:
+            return ascii_run_sse42<ALPHA>(bytes, n);
+        default:
+            break;
+    }
+#endif
+    return ascii_run_scalar<ALPHA>(bytes, 0, n);
+}
+
+// Byte offset of the first character of s[0, n) that is not valid UTF-8 (as checked by char_starts), n if s is valid
+inline size_t invalid_offset(const char* s, size_t n) {
+    auto bytes = reinterpret_cast<const uint8_t*>(s);
+    for (size_t i = 0; i < n; ) {
+        uint8_t len = char_len(bytes[i]);
+        if (len == 0 || i + len > n) {
+            return i;
+        }
+        for (uint8_t k = 1; k < len; k++) {
+            if ((bytes[i + k] & 0xC0) != 0x80) {
+                return i;
+            }
+        }
+        i += len;
+    }
+    return n;
+}
+
+// Number of UTF-8 characters in s[0, n), INVALID if s is not valid UTF-8
+inline size_t count_chars(const char* s, size_t n) {
+    auto bytes = reinterpret_cast<const uint8_t*>(s);
+    size_t count = 0;
+    for (size_t i = 0; i < n; count++) {
+        uint8_t len = char_len(bytes[i]);
+        if (len == 0 || i + len > n) {
+            return INVALID;
+        }
+        for (uint8_t k = 1; k < len; k++) {
+            if ((bytes[i + k] & 0xC0) != 0x80) {
+                return INVALID;
+            }
+        }
+        i += len;
+    }
+    return count;
+}
+
+} // namespace utf8
+
+#endif // LLACA_UTF8_H
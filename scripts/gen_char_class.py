@@ -0,0 +1,112 @@
+# Generate automaton/src/char_class.h, the character classes used by the pre-tokenization rules
+# of Automaton::cut. The classes are taken from the regexes of the rules in automaton/src/pretokenize.h,
+# so the C++ rules follow the Unicode version of the installed `regex` module.
+#
+# Usage: python scripts/gen_char_class.py [output_path]
+
+import os
+import sys
+
+import regex as re
+
+MAX_CODE_POINT = 0x110000
+BLOCK_BITS = 8
+BLOCK_SIZE = 1 << BLOCK_BITS
+
+# (name, regex for a single character, comment)
+CLASSES = [
+    ("SYMBOL", r"\p{P}|\p{S}", "Punctuation and symbols, default edge scores min_prob / 2"),
+    ("DIGIT", r"\d", "Digits of a number"),
+    ("SIGN", r"[-+]", "Optional sign before a number"),
+    ("NUM_SEP", r"\.|\．|\:|\：|\-|\－|\/", "Separator between the digit groups of a number"),
+    ("ALPHA", r"[a-zA-Z]", "Letters of an English word"),
+    ("ALPHA_SEP", r"['-]", "Separator between the letter groups of an English word"),
+]
+
+
+def classify():
+    patterns = [re.compile(pattern) for _, pattern, _ in CLASSES]
+    table = bytearray(MAX_CODE_POINT)
+    for cp in range(MAX_CODE_POINT):
+        if 0xD800 <= cp < 0xE000:  # Surrogates never appear in valid UTF-8
+            continue
+        char = chr(cp)
+        cls = 0
+        for bit, pattern in enumerate(patterns):
+            if pattern.fullmatch(char):
+                cls |= 1 << bit
+        table[cp] = cls
+    return table
+
+
+def split_blocks(table):
+    blocks, index = [], []
+    seen = {}
+    for start in range(0, MAX_CODE_POINT, BLOCK_SIZE):
+        block = bytes(table[start:start + BLOCK_SIZE])
+        if block not in seen:
+            seen[block] = len(blocks)
+            blocks.append(block)
+        index.append(seen[block])
+    return blocks, index
+
+
+def format_rows(values, per_row, indent="    "):
+    rows = []
+    for i in range(0, len(values), per_row):
+        rows.append(indent + ", ".join(str(v) for v in values[i:i + per_row]) + ",")
+    return "\n".join(rows)
+
+
+def render(blocks, index):
+    flags = "\n".join(
+        f"static const uint8_t {name} = {1 << bit}; // {comment}"
+        for bit, (name, _, comment) in enumerate(CLASSES)
+    )
+    block_rows = "\n".join(
+        "    {\n" + format_rows(list(block), 32, "        ") + "\n    },"
+        for block in blocks
+    )
+    return f"""#ifndef TRIE_GRAM_CHAR_CLASS_H
+#define TRIE_GRAM_CHAR_CLASS_H
+
+// Generated by scripts/gen_char_class.py with regex {re.__version__}, do not edit.
+// Character classes of the pre-tokenization rules, looked up through a two-stage table:
+// the code point block (cp >> {BLOCK_BITS}) selects one of the distinct {BLOCK_SIZE}-entry blocks.
+
+#include <cstdint>
+
+namespace char_class {{
+
+{flags}
+
+static const uint32_t BLOCK_BITS = {BLOCK_BITS};
+static const uint32_t BLOCK_COUNT = {len(blocks)};
+
+static const uint{16 if len(blocks) > 255 else 8}_t BLOCK_INDEX[{len(index)}] = {{
+{format_rows(index, 32)}
+}};
+
+static const uint8_t BLOCKS[BLOCK_COUNT][{BLOCK_SIZE}] = {{
+{block_rows}
+}};
+
+// Classes of code point cp (< 0x110000)
+inline uint8_t lookup(uint32_t cp) {{
+    return BLOCKS[BLOCK_INDEX[cp >> BLOCK_BITS]][cp & ((1 << BLOCK_BITS) - 1)];
+}}
+
+}} // namespace char_class
+
+#endif // TRIE_GRAM_CHAR_CLASS_H
+"""
+
+
+if __name__ == "__main__":
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    output_path = sys.argv[1] if len(sys.argv) > 1 else os.path.join(root, "automaton", "src", "char_class.h")
+
+    blocks, index = split_blocks(classify())
+    with open(output_path, "w", encoding="utf-8") as f:
+        f.write(render(blocks, index))
+    print(f"{output_path}: {len(blocks)} blocks")
@@ -0,0 +1,58 @@
+# Compile dictionaries into a static library with a specialized cut, for dictionaries that never change.
+# Builds an Automaton, writes its tables as constexpr arrays into <name>.h / <name>.cpp
+# (Automaton.write_source) and compiles them into lib<name>.a. Programs linking it call
+# automaton::<name>::cut / cut_join / cut_bounds, with the same results as Automaton.cut
+# and nothing to load at startup.
+#
+# Usage: python scripts/gen_static_dict.py NAME OUTPUT_DIR DICT_PATH [DICT_PATH ...] [--no-lib]
+# e.g.   python scripts/gen_static_dict.py pku build/static data/dict/pku_dict.utf8
+#
+# The compiler is taken from $CXX (default c++), the archiver from $AR (default ar).
+
+import argparse
+import os
+import subprocess
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+from automaton import Automaton
+
+
+def generate(name, output_dir, dict_paths):
+    os.makedirs(output_dir, exist_ok=True)
+    header_path = os.path.join(output_dir, f"{name}.h")
+    source_path = os.path.join(output_dir, f"{name}.cpp")
+
+    ac = Automaton(dict_paths)
+    ac.write_source(name, header_path, source_path)
+    print(f"{source_path}: {ac.word_count()} words")
+    return source_path
+
+
+def build_library(name, output_dir, source_path):
+    object_path = os.path.join(output_dir, f"{name}.o")
+    library_path = os.path.join(output_dir, f"lib{name}.a")
+
+    cxx = os.environ.get("CXX", "c++")
+    ar = os.environ.get("AR", "ar")
+    subprocess.run([cxx, "-std=c++11", "-O2", "-fPIC", f"-I{ROOT}", f"-I{output_dir}",
+                    "-c", source_path, "-o", object_path], check=True)
+    if os.path.exists(library_path):
+        os.remove(library_path)
+    subprocess.run([ar, "rcs", library_path, object_path], check=True)
+    print(f"{library_path}: link with -L{output_dir} -l{name}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Compile dictionaries into a static segmentation library")
+    parser.add_argument("name", help="C++ namespace and library name")
+    parser.add_argument("output_dir")
+    parser.add_argument("dict_paths", nargs="+")
+    parser.add_argument("--no-lib", action="store_true", help="Only write the header and source")
+    args = parser.parse_args()
+
+    source_path = generate(args.name, args.output_dir, args.dict_paths)
+    if not args.no_lib:
+        build_library(args.name, args.output_dir, source_path)
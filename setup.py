@@ -4,10 +4,12 @@ from Cython.Build import cythonize
 ext_modules = [
     Extension(
         name="automaton.Automaton",
-        sources=["automaton/automaton.pyx", "automaton/src/automaton.cpp"],
+        sources=["automaton/automaton.pyx", "automaton/src/automaton.cpp", "automaton/src/stream_segmenter.cpp",
+                 "automaton/src/segmentation_cache.cpp"],
         language="c++",
         include_dirs=["."],
-        extra_compile_args=["-std=c++11", "-O2"],
+        extra_compile_args=["-std=c++11", "-O2", "-pthread"],
+        extra_link_args=["-pthread"],
     ),
     Extension(
         name="suffix_array.SuffixArray",
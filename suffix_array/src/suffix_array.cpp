@@ -2,12 +2,20 @@
 
 namespace suffix_array {
 
-bool SuffixArray::cmp(uint64_t x, uint64_t y, uint64_t w) {
+// Header of SuffixArray::serialize, followed by the text and sa[1..count] in `width` bytes each
+struct SerializedHeader {
+    char magic[8];
+    uint64_t text_size, count, width;
+};
+
+static const char SERIALIZED_MAGIC[8] = {'L', 'L', 'A', 'C', 'A', 'S', 'A', '1'};
+
+bool SuffixArray::cmp(uint64_t x, uint64_t y, uint64_t w) const {
     return oldrk[x] == oldrk[y] && oldrk[x + w] == oldrk[y + w];
 }
 
 // Compare s[pos:] and t, return true if s[pos:] < t, otherwise return false
-bool SuffixArray::cmp(uint64_t pos, const std::string& t) { 
+bool SuffixArray::cmp(uint64_t pos, const std::string& t) const { 
     for (uint64_t i = 0; i < t.size(); i++) {
         if (pos + i >= s.size()) {
             return true;
@@ -20,7 +28,7 @@ bool SuffixArray::cmp(uint64_t pos, const std::string& t) {
 }
 
 // Compare t and s[pos:], return true if t < s[pos:], otherwise return false
-bool SuffixArray::cmp(const std::string& t, uint64_t pos) { 
+bool SuffixArray::cmp(const std::string& t, uint64_t pos) const { 
     for (uint64_t i = 0; i < t.size(); i++) {
         if (pos + i >= s.size()) {
             return false;
@@ -33,20 +41,23 @@ bool SuffixArray::cmp(const std::string& t, uint64_t pos) {
 }
 
 uint64_t SuffixArray::utf8_get_len(uint8_t byte) {
-    if ((byte & 0x80) == 0x00) { // Single byte, 0xxxxxxx
-        return 1;
-    } else if ((byte & 0xE0) == 0xC0) { // Two bytes, 110xxxxx
-        return 2;
-    } else if ((byte & 0xF0) == 0xE0) { // Three bytes, 1110xxxx
-        return 3;
-    } else if ((byte & 0xF8) == 0xF0) { // Four bytes, 11110xxx
-        return 4;
-    } else { // byte is not a valid UTF-8 start byte
-        return 0;
-    }
+    return utf8::char_len(byte); // 0 if byte is not a valid UTF-8 start byte
 }
 
-SuffixArray::SuffixArray(const std::string& s) : s(s) {
+SuffixArray::SuffixArray(const std::string& s) : text(s), s(text.data(), text.size()) {
+    build();
+}
+
+SuffixArray::SuffixArray(const char* data, uint64_t n) : s(data, n) {
+    build();
+}
+
+void SuffixArray::build() {
+    std::vector<uint64_t> utf8_start;
+    if (!utf8::char_starts(s.data(), s.size(), utf8_start)) {
+        throw std::invalid_argument("Invalid UTF-8 string");
+    }
+
     uint64_t n = s.size(), m = SIZE;
     std::vector<uint64_t> cnt(std::max(n, m) + 1), key(n + 1), id(n + 1);
     sa.resize(n + 1), oldrk.resize(2 * n + 1), rk.resize(2 * n + 1);
@@ -105,8 +116,7 @@ SuffixArray::SuffixArray(const std::string& s) : s(s) {
     copy(rk.begin(), rk.end(), oldrk.begin());
     std::vector<uint64_t> real_rk;
     id.clear();
-    for (uint64_t i = 0, len = 0; i < n; i += len) {
-        len = utf8_get_len(s[i]);
+    for (auto i : utf8_start) {
         real_rk.push_back(rk[i + 1]);
         id.push_back(i + 1);
     }
@@ -121,23 +131,89 @@ SuffixArray::SuffixArray(const std::string& s) : s(s) {
     }
 }
 
-uint64_t SuffixArray::size() {
+std::string SuffixArray::serialize() const {
+    SerializedHeader header;
+    memcpy(header.magic, SERIALIZED_MAGIC, sizeof(header.magic));
+    header.text_size = s.size();
+    header.count = size();
+    header.width = s.size() <= UINT32_MAX ? 4 : 8; // Positions fit in 32 bits for texts below 4 GiB
+
+    std::string res;
+    res.reserve(sizeof(header) + s.size() + header.count * header.width);
+    res.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    res.append(s.data(), s.size());
+    for (uint64_t i = 1; i <= header.count; i++) {
+        if (header.width == 4) {
+            auto pos = static_cast<uint32_t>(sa[i]);
+            res.append(reinterpret_cast<const char*>(&pos), sizeof(pos));
+        } else {
+            res.append(reinterpret_cast<const char*>(&sa[i]), sizeof(sa[i]));
+        }
+    }
+    return res;
+}
+
+void SuffixArray::deserialize(const char* data, uint64_t n) {
+    SerializedHeader header;
+    if (n < sizeof(header)) {
+        throw std::invalid_argument("Invalid serialized suffix array");
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SERIALIZED_MAGIC, sizeof(header.magic)) != 0 ||
+        (header.width != 4 && header.width != 8) ||
+        header.text_size > n - sizeof(header) || header.count > header.text_size ||
+        n - sizeof(header) - header.text_size < header.count * header.width) {
+        throw std::invalid_argument("Invalid serialized suffix array");
+    }
+
+    TextView view(data + sizeof(header), header.text_size);
+    std::vector<uint64_t> utf8_start;
+    if (!utf8::char_starts(view.data(), view.size(), utf8_start) || utf8_start.size() != header.count) {
+        throw std::invalid_argument("Invalid serialized suffix array");
+    }
+
+    // rk is the inverse of sa over the character starts
+    const char* p = view.data() + view.size();
+    std::vector<uint64_t> new_sa(header.count + 1), new_rk(header.count);
+    for (uint64_t i = 1; i <= header.count; i++, p += header.width) {
+        if (header.width == 4) {
+            uint32_t pos;
+            memcpy(&pos, p, sizeof(pos));
+            new_sa[i] = pos;
+        } else {
+            memcpy(&new_sa[i], p, sizeof(new_sa[i]));
+        }
+        auto it = std::lower_bound(utf8_start.begin(), utf8_start.end(), new_sa[i]);
+        if (it == utf8_start.end() || *it != new_sa[i]) {
+            throw std::invalid_argument("Invalid serialized suffix array");
+        }
+        new_rk[it - utf8_start.begin()] = i;
+    }
+
+    text.clear();
+    s = view;
+    sa.swap(new_sa);
+    rk.swap(new_rk);
+    oldrk.clear();
+}
+
+uint64_t SuffixArray::size() const {
     return rk.size();
 }
 
-uint64_t SuffixArray::get_id(uint64_t suf_rank) { // 1-index
+uint64_t SuffixArray::get_id(uint64_t suf_rank) const { // 1-index
     return sa[suf_rank];
 }
 
-std::string SuffixArray::get_suf(uint64_t suf_rank) { // 1-index
+std::string SuffixArray::get_suf(uint64_t suf_rank) const { // 1-index
     return s.substr(sa[suf_rank]);
 }
 
-uint64_t SuffixArray::get_rank(uint64_t suf_id) { // 0-index
+uint64_t SuffixArray::get_rank(uint64_t suf_id) const { // 0-index
     return rk[suf_id];
 }
 
-uint64_t SuffixArray::lower_bound(const std::string& t) {
+uint64_t SuffixArray::lower_bound(const std::string& t) const {
     uint64_t l = 1, r = size() + 1; // rank
     while (l < r) {
         uint64_t mid = (l + r) >> 1;
@@ -149,7 +225,7 @@ uint64_t SuffixArray::lower_bound(const std::string& t) {
     return l;
 }
 
-uint64_t SuffixArray::upper_bound(const std::string& t) {
+uint64_t SuffixArray::upper_bound(const std::string& t) const {
     uint64_t l = 1, r = size() + 1; // rank
     while (l < r) {
         uint64_t mid = (l + r) >> 1;
@@ -161,11 +237,11 @@ uint64_t SuffixArray::upper_bound(const std::string& t) {
     return l;
 }
 
-uint64_t SuffixArray::get_count(const std::string& t) {
+uint64_t SuffixArray::get_count(const std::string& t) const {
     return upper_bound(t) - lower_bound(t);
 }
 
-std::vector<std::pair<std::string, double>> SuffixArray::get_prob(const std::string &t) {
+std::vector<std::pair<std::string, double>> SuffixArray::get_prob(const std::string &t) const {
     std::vector<std::pair<std::string, double>> prob;
     uint64_t l = lower_bound(t), r = upper_bound(t); // rank [l, r)
     uint64_t p = l;
@@ -196,7 +272,7 @@ std::vector<std::pair<std::string, double>> SuffixArray::get_prob(const std::str
         
     return prob;
 }
-double SuffixArray::get_branch_entropy(const std::string &t) {
+double SuffixArray::get_branch_entropy(const std::string &t) const {
     double be = 0;
     auto prob_list = get_prob(t);
     for (const auto& p : prob_list) {
@@ -205,7 +281,7 @@ double SuffixArray::get_branch_entropy(const std::string &t) {
     }
     return be;
 }
-double SuffixArray::get_mutual_information(const std::string &t) {
+double SuffixArray::get_mutual_information(const std::string &t) const {
     if (t.size() <= 1) {
         return 0;
     }
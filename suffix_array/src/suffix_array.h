@@ -7,35 +7,68 @@
 #include <map>
 #include <iostream>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "../../common/utf8.h"
 
 namespace suffix_array {
 
 static const uint64_t SIZE = (1 << 8) - 1; // One byte
 
+// Read-only view of the indexed text, which is owned by the suffix array or by the caller
+class TextView {
+private:
+    const char* _data;
+    uint64_t _size;
+
+public:
+    TextView(const char* data = "", uint64_t size = 0) : _data(data), _size(size) {}
+
+    const char* data() const { return _data; }
+    uint64_t size() const { return _size; }
+    char operator[](uint64_t i) const { return i < _size ? _data[i] : '\0'; } // '\0' past the end, as std::string
+    std::string substr(uint64_t pos, uint64_t len = std::string::npos) const {
+        return std::string(_data + pos, std::min(len, _size - pos));
+    }
+};
+
 class SuffixArray {
 private:
     // sa[i]: The i-th suffix rank
     // id[i]: Similar to sa[i]
     // rk[i]: The rank of the i-th suffix
-    std::string s;
+    std::string text; // Copy of the text, unless it is indexed in place
+    TextView s;
     std::vector<uint64_t> sa, oldrk, rk;
-    bool cmp(uint64_t x, uint64_t y, uint64_t w);
-    bool cmp(uint64_t pos, const std::string &t);
-    bool cmp(const std::string &t, uint64_t pos);
-    uint64_t lower_bound(const std::string &t);
-    uint64_t upper_bound(const std::string &t);
+    bool cmp(uint64_t x, uint64_t y, uint64_t w) const;
+    bool cmp(uint64_t pos, const std::string &t) const;
+    bool cmp(const std::string &t, uint64_t pos) const;
+    uint64_t lower_bound(const std::string &t) const;
+    uint64_t upper_bound(const std::string &t) const;
     static uint64_t utf8_get_len(uint8_t byte);
+    void build();
 public:
     SuffixArray() = default;
     SuffixArray(const std::string& s); 
-    uint64_t size();
-    uint64_t get_id(uint64_t suf_rank); // 1-index
-    std::string get_suf(uint64_t suf_rank); // 1-index
-    uint64_t get_rank(uint64_t suf_id); // 0-index
-    uint64_t get_count(const std::string& t);
-    std::vector<std::pair<std::string, double>> get_prob(const std::string& t);
-    double get_branch_entropy(const std::string& t);
-    double get_mutual_information(const std::string& t);
+    SuffixArray(const char* data, uint64_t n); // Indexes data[0, n) in place, it must outlive the suffix array
+    SuffixArray(const SuffixArray&) = delete; // s may point into text
+    SuffixArray& operator=(const SuffixArray&) = delete;
+    uint64_t size() const;
+    uint64_t get_id(uint64_t suf_rank) const; // 1-index
+    std::string get_suf(uint64_t suf_rank) const; // 1-index
+    uint64_t get_rank(uint64_t suf_id) const; // 0-index
+    uint64_t get_count(const std::string& t) const;
+    std::vector<std::pair<std::string, double>> get_prob(const std::string& t) const;
+    double get_branch_entropy(const std::string& t) const;
+    double get_mutual_information(const std::string& t) const;
+
+    // Binary image for deserialize: the text and the suffix order (the ranks are recomputed from it)
+    std::string serialize() const;
+    // Replace the suffix array by a serialized one at the start of data[0, n) (bytes after it are ignored).
+    // Its text is used in place, so data must outlive the suffix array.
+    void deserialize(const char* data, uint64_t n);
 };
 
 } // namespace suffix_array
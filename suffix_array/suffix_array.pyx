@@ -5,6 +5,9 @@ from libcpp.vector cimport vector
 from libcpp.string cimport string
 from libcpp.map cimport pair
 
+import pickle
+from multiprocessing import shared_memory
+
 cdef extern from "stdint.h":
     ctypedef unsigned char uint8_t
     ctypedef unsigned long long uint64_t
@@ -12,36 +15,82 @@ cdef extern from "stdint.h":
 cdef extern from "src/suffix_array.h" namespace "suffix_array":
     cdef cppclass SuffixArrayImpl "suffix_array::SuffixArray":
         SuffixArrayImpl() except +
-        SuffixArrayImpl(const string& s) except +
+        SuffixArrayImpl(const string& s) except + nogil
+        SuffixArrayImpl(const char* data, uint64_t n) except + nogil
         uint64_t size() except +
         uint64_t get_id(uint64_t suf_rank) except +
         string get_suf(uint64_t suf_rank) except +
         uint64_t get_rank(uint64_t suf_id) except +
-        uint64_t get_count(const string& t) except +
-        vector[pair[string, double]] get_prob(const string& t) except +
-        double get_branch_entropy(const string& t) except +
-        double get_mutual_information(const string& t) except +
+        uint64_t get_count(const string& t) except + nogil
+        vector[pair[string, double]] get_prob(const string& t) except + nogil
+        double get_branch_entropy(const string& t) except + nogil
+        double get_mutual_information(const string& t) except + nogil
+        string serialize() except + nogil
+        void deserialize(const char* data, uint64_t n) except + nogil
 
 cdef class SuffixArray:
     cdef SuffixArrayImpl* sa
+    cdef const unsigned char[::1] text # UTF-8 text (or serialized image) indexed in place, held as long as the suffix array
 
-    def __cinit__(self, file_paths = None, text = None):
+    def __init__(self, file_paths = None, text = None):
+        # text is a str or UTF-8 in a bytes-like object (bytes, bytearray, memoryview, mmap), which is not copied
         if not file_paths and not text:
             raise ValueError("Either file_paths or text must be provided.")
 
         if isinstance(file_paths, str):
             file_paths = [file_paths]
         if file_paths:
-            text = ''
+            texts = []
             for file_path in file_paths:
                 with open(file_path, 'r', encoding='utf-8') as file:
-                    text += file.read() + "\n"
-        self.sa = new SuffixArrayImpl(text.encode('utf-8'))
-
+                    texts.append(file.read() + "\n")
+            text = ''.join(texts)
+        self.text = text.encode('utf-8') if isinstance(text, str) else text
+        cdef const char* data = <const char*>&self.text[0]
+        cdef uint64_t n = self.text.shape[0]
+        del self.sa
+        self.sa = NULL
+        with nogil: # Other Python threads run while the suffix array is sorted
+            self.sa = new SuffixArrayImpl(data, n)
 
     def __dealloc__(self):
         del self.sa
 
+    def to_bytes(self) -> bytes:
+        # Binary image of the text and the suffix order, read back by from_bytes without sorting again
+        cdef string image
+        with nogil:
+            image = self.sa.serialize()
+        return image
+
+    @staticmethod
+    def from_bytes(data):
+        # Suffix array from the image of to_bytes at the start of a bytes-like object (bytes, memoryview,
+        # SharedMemory.buf). The text is used in place, so the buffer is held as long as the suffix array
+        cdef SuffixArray res = SuffixArray.__new__(SuffixArray)
+        res.text = data
+        cdef const char* cpp_data = <const char*>&res.text[0] if res.text.shape[0] else NULL
+        cdef uint64_t n = res.text.shape[0]
+        res.sa = new SuffixArrayImpl()
+        with nogil:
+            res.sa.deserialize(cpp_data, n)
+        return res
+
+    def to_shared_memory(self):
+        # The image of to_bytes in a new multiprocessing SharedMemory. It pickles by name, so workers
+        # attach to it and call from_bytes(shm.buf) instead of receiving the image. The caller unlinks it.
+        image = self.to_bytes()
+        shm = shared_memory.SharedMemory(create=True, size=len(image))
+        shm.buf[:len(image)] = image
+        return shm
+
+    def __reduce_ex__(self, protocol):
+        # Pickled as the image of to_bytes, out of band with protocol 5 (pickle.PickleBuffer)
+        image = self.to_bytes()
+        if protocol >= 5:
+            image = pickle.PickleBuffer(image)
+        return SuffixArray.from_bytes, (image,)
+
     def size(self):
         return self.sa.size()
 
@@ -59,17 +108,32 @@ cdef class SuffixArray:
         return self.sa.get_rank(suf_id)
     
     def get_count(self, pattern):
-        return self.sa.get_count(pattern.encode('utf-8'))
+        cdef string cpp_pattern = pattern.encode('utf-8')
+        cdef uint64_t count
+        with nogil:
+            count = self.sa.get_count(cpp_pattern)
+        return count
 
     def get_prob(self, prompt):
-        cdef vector[pair[string, double]] cpp_prob = self.sa.get_prob(prompt.encode('utf-8'))
+        cdef string cpp_prompt = prompt.encode('utf-8')
+        cdef vector[pair[string, double]] cpp_prob
+        with nogil:
+            cpp_prob = self.sa.get_prob(cpp_prompt)
         prob = []
         for item in cpp_prob:
             prob.append({'token': item.first.decode('utf-8'), 'prob': item.second})
         return prob
         
     def get_branch_entropy(self, prompt):
-        return self.sa.get_branch_entropy(prompt.encode('utf-8'))
+        cdef string cpp_prompt = prompt.encode('utf-8')
+        cdef double entropy
+        with nogil:
+            entropy = self.sa.get_branch_entropy(cpp_prompt)
+        return entropy
 
     def get_mutual_information(self, prompt):
-        return self.sa.get_mutual_information(prompt.encode('utf-8'))
+        cdef string cpp_prompt = prompt.encode('utf-8')
+        cdef double pmi
+        with nogil:
+            pmi = self.sa.get_mutual_information(cpp_prompt)
+        return pmi
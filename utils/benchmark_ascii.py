@@ -0,0 +1,55 @@
+import LLACA
+from utils import DATA_PATH
+from utils.benchmark_batch import time_best
+
+import random
+import time
+
+
+def ascii_lines(count, runs=8, seed=0):
+    """Lines of long ASCII digit and letter runs (IDs, hashes, numbers), as in logs and crawled pages"""
+    rng = random.Random(seed)
+    letters = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    lines = []
+    for _ in range(count):
+        words = []
+        for _ in range(runs):
+            chars = "0123456789" if rng.random() < 0.5 else letters
+            words.append("".join(rng.choice(chars) for _ in range(rng.randint(20, 120))))
+        lines.append(" ".join(words))
+    return lines
+
+def benchmark_ascii(dict_names, count=2000, repeat=5):
+    """Throughput of `cut_offsets` (no str created) on ASCII runs and on the test set of each dictionary.
+    Characters of a run that no keyword starts with skip the automaton, so the ASCII runs should cut
+    faster than the test text even though the shipped dictionaries contain ASCII digits and letters."""
+    lines = ascii_lines(count)
+    ascii_bytes = sum(len(line) for line in lines)
+    buffer = "\n".join(lines).encode("utf-8")
+    copy_time = time_best(lambda: bytes(bytearray(buffer)), repeat)
+    print(f"ASCII runs: {len(lines)} lines, {ascii_bytes / (1 << 20):.1f} MiB, copied at {len(buffer) / copy_time / 1e6:.0f} MB/s")
+
+    summary = []
+    for name in dict_names:
+        with open(f"{DATA_PATH}/test/{name}_test.utf8", "r", encoding="utf-8") as f:
+            test_lines = [line.rstrip("\n") for line in f]
+        test_bytes = sum(len(line.encode("utf-8")) for line in test_lines)
+
+        t0 = time.time()
+        ac = LLACA.Automaton(f"{DATA_PATH}/dict/{name}_dict.utf8")
+        print(f"{name}: built in {time.time() - t0:.3f} s")
+
+        ascii_time = time_best(lambda: ac.cut_offsets(lines), repeat)
+        test_time = time_best(lambda: ac.cut_offsets(test_lines), repeat)
+        summary.append((name, ascii_bytes / ascii_time / 1e6, test_bytes / test_time / 1e6))
+        del ac
+
+    print("\n================= ASCII Run Benchmark Summary =================")
+    print(f"{'Dictionary':<15} {'ASCII MB/s':<15} {'Test MB/s':<15} {'Speedup':<15}")
+    for name, ascii_speed, test_speed in summary:
+        print(f"{name:<15} {ascii_speed:<15.1f} {test_speed:<15.1f} {ascii_speed / test_speed:<15.2f}")
+
+if __name__ == "__main__":
+    dicts = ["as", "cityu", "ctb", "msr", "pku", "kwdlc", "ud_ja", "best"]
+
+    benchmark_ascii(dicts)
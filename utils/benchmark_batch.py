@@ -0,0 +1,44 @@
+import LLACA
+from utils import DATA_PATH
+
+import time
+
+
+def time_best(fn, repeat):
+    best = float("inf")
+    for _ in range(repeat):
+        t0 = time.time()
+        fn()
+        best = min(best, time.time() - t0)
+    return best
+
+def benchmark_batch(dict_names, test_names, streams_list=(1, 4, 8, 16, 32), repeat=3):
+    """Compare `cut` line by line with `cut_batch` at different stream counts.
+    Interleaving pays off most when the automaton is larger than the last level cache,
+    so all dictionaries are merged into one automaton by default."""
+    dict_paths = [f"{DATA_PATH}/dict/{name}_dict.utf8" for name in dict_names]
+    lines = []
+    for name in test_names:
+        with open(f"{DATA_PATH}/test/{name}_test.utf8", "r", encoding="utf-8") as f:
+            lines += [line.rstrip("\n") for line in f]
+    total_bytes = sum(len(line.encode("utf-8")) for line in lines)
+
+    ac = LLACA.Automaton(dict_paths)
+    print(f"Automaton: {ac.word_count()} words, {ac.memory_usage() / (1 << 20):.0f} MiB")
+    print(f"Text: {len(lines)} lines, {total_bytes / (1 << 20):.1f} MiB")
+
+    summary = [("cut", time_best(lambda: [ac.cut(line, delim=" ") for line in lines], repeat))]
+    for streams in streams_list:
+        cut_time = time_best(lambda: ac.cut_batch(lines, delim=" ", streams=streams), repeat)
+        summary.append((f"cut_batch({streams})", cut_time))
+
+    print("\n================= Batch Benchmark Summary =================")
+    print(f"{'Method':<15} {'Cut Time (s)':<15} {'MB/s':<15} {'Speedup':<15}")
+    for method, cut_time in summary:
+        print(f"{method:<15} {cut_time:<15.3f} {total_bytes / cut_time / 1e6:<15.1f} {summary[0][1] / cut_time:<15.2f}")
+
+if __name__ == "__main__":
+    dicts = ["as", "cityu", "ctb", "msr", "pku", "kwdlc", "ud_ja", "best"]
+    tests = ["as", "cityu", "ctb", "msr", "pku", "kwdlc", "ud_ja", "best"]
+
+    benchmark_batch(dicts, tests)